@@ -17,6 +17,23 @@
 **    h - set rho (angle of rotation) to zero again
 **    r - record control points into text file
 **    l - load control points from text file
+**    + - halve the surface tolerance (finer tessellation)
+**    - - double the surface tolerance (coarser tessellation)
+**    t - cycle the texture: marble file, procedural marble, wood,
+**        checker, noise
+**    z - cycle the procedural texture size from 64 to 2048 pixels
+**    x - cycle the procedural noise cells, stripes or checks per
+**        side from 2 to 64
+**    v - next procedural noise seed
+**    f - toggle per-pixel lighting of the shaded surface; default is
+**        on, fixed-function lighting is used when it is off or GLSL is
+**        not available
+**    w - write the surface to surface.obj, decimated to the
+**        decimation error
+**    < - halve the decimation error
+**    > - double the decimation error
+**    o - Toggle the scene loaded from scene.txt; default is off
+**    m - print volume, surface area, centroid and moments of inertia
 **
 **  If "selection mode" is on, right click finds the nearest point
 **  and highlights it. Left click performs translation. When
@@ -25,6 +42,22 @@
 **  Rotation of the points, curves, and surfaces can be performed
 **  by rotating about the x-axis.
 **
+**  Command-line options:
+**
+**    -record <file>  log every mouse, motion, keyboard and reshape
+**                    event with a timestamp into <file>
+**    -replay <file>  feed a recorded trace back through the input
+**                    callbacks without opening a window, and print
+**                    per-event latency histograms; the mesh cache on
+**                    disk is neither read nor written
+**    -closest <file> for every "x y z" line of <file>, print the
+**                    distance to the surface of revolution of the
+**                    control points in bspline.txt, the profile
+**                    parameter and the rotation angle of the closest
+**                    point
+**    -closest-curve <file>
+**                    the same against the profile curve itself
+**
 **  [X] Control point input On/Off: When ON, user can add control 
 **      points
 **  [X] Control polygon On/Off: When ON, program will display 
@@ -45,17 +78,28 @@
 **      wireframe mesh
 **  [X] Shade surface: shade the B-spline surface using pre-specified
 **      lighting and material parameters
-**  [ ] Texture surface: allow the user to texture map either an
+**  [X] Texture surface: allow the user to texture map either an
 **      image or a texture pattern onto the B-spline surface; user
 **      can choose between the options
 **  [.] Have documentation available
 **
 */
 
+#define GL_GLEXT_PROTOTYPES     /* GLSL entry points are exported by libGL */
 #include <GL/glut.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef enum {
   BSPLINE,
@@ -63,12 +107,6 @@ typedef enum {
 
 static curveType selectCurve = BSPLINE;
 
-typedef struct Vectors{
-  GLfloat x;
-  GLfloat y;
-  GLfloat z;
-}Vector;
-
 static void keyboard(unsigned char key, int x, int y);
 static void lightingInit();
 
@@ -96,45 +134,235 @@ static GLfloat knot[MAX_KNOTS];
 static GLfloat bspline[MAX_BPTS][3];
 static int num_bspline_pts = 0;
 
-#define ANGLE_PARTITION 0.125
-#define DEGREES_OF_REVOLUTION 360
-static GLfloat bspline_copy[MAX_BPTS][3];
-static GLfloat bspline_surface[DEGREES_OF_REVOLUTION][MAX_BPTS][6][3];
+#define PROFILE_DEGREE 3
+#define PROFILE_DERIVATIVES 3      /* point, first and second derivative */
+
+/* Exact form of the surface of revolution: the clamped cubic B-spline
+   profile, swept about the y-axis. As a NURBS surface this is the profile
+   times a 9-point rational circle, but every point of that circle is a
+   rotation of the profile, so only the profile is stored and the sweep is
+   evaluated exactly with sin and cos. */
+typedef struct NurbsSurfaces{
+  int nu;                          /* profile control points, 0 if too few */
+  GLfloat uknot[MAX_KNOTS];
+  GLfloat profile[MAX_CPTS][3];
+  unsigned int generation;         /* changes whenever the profile is rebuilt */
+}NurbsSurface;
+
+/* Tessellated grid: rows run along the profile, cols around the axis with
+   the seam column repeated */
+typedef struct Meshes{
+  int rows;
+  int cols;
+  GLfloat* vertex;                 /* rows*cols*3 */
+  GLfloat* normal;                 /* rows*cols*3, analytic unit normals */
+  GLfloat* texcoord;               /* rows*cols*2, angle and profile arc length */
+  int nindex;
+  GLuint* index;                   /* triangle list */
+  void* mapping;                   /* set when the arrays live in a mapped cache file */
+  size_t mapping_size;
+}Mesh;
+
+typedef struct TessellationPlans{
+  int segments[MAX_CPTS];          /* samples per knot span, indexed by span */
+  int rows;
+  int cols;
+}TessellationPlan;
+
+#define RING_TABLE_ENTRIES 8
+
+typedef struct RingTables{
+  int cols;                        /* 0 marks an empty slot */
+  GLfloat* cos_sin;                /* cols (cos, sin) pairs */
+}RingTable;
+
+static RingTable ring_tables[RING_TABLE_ENTRIES];
+static int ring_table_next = 0;
+
+/* On-disk mesh cache: <key>.mesh files holding this header followed by
+   the vertex, normal, texcoord and index arrays */
+#define MESH_CACHE_DIRECTORY "mesh_cache"   /* unless SURFACE_MESH_CACHE is set */
+#define MESH_CACHE_BUDGET 64       /* megabytes, unless SURFACE_MESH_CACHE_BUDGET is set */
+#define MESH_FILE_MAGIC "SORM"
+#define MESH_FILE_VERSION 3
+
+typedef struct MeshFileHeaders{
+  char magic[4];
+  unsigned int version;
+  unsigned long long key;
+  int rows;
+  int cols;
+  int nindex;
+  int reserved;
+}MeshFileHeader;
+
+typedef struct MeshCacheFiles{
+  char path[PATH_MAX];
+  size_t size;
+  time_t last_use;
+}MeshCacheFile;
+
+#define DEFAULT_SURFACE_TOLERANCE 0.002
+#define MIN_SURFACE_TOLERANCE 0.00001
+#define MAX_SURFACE_TOLERANCE 0.1
+#define MAX_SPAN_SEGMENTS 256
+#define MIN_RING_SEGMENTS 8
+#define MAX_RING_SEGMENTS 2048
+#define MESH_CACHE_ENTRIES 4
+#define MESH_NORMALS 1             /* drawMesh() attribute flags */
+#define MESH_TEXCOORDS 2
+
+typedef struct MeshCacheEntries{
+  unsigned int generation;         /* 0 marks an empty slot */
+  GLfloat tolerance;
+  unsigned long last_use;
+  Mesh mesh;
+}MeshCacheEntry;
+
+#define GAUSS_POINTS 8
+#define AREA_SUBINTERVALS 4
+
+typedef struct MassPropertiesStruct{
+  double volume;
+  double area;                     /* of the revolved profile, without end caps */
+  double centroid;                 /* y of the solid's centroid; it lies on the axis */
+  double area_centroid;            /* y of the surface's centroid */
+  double axial_inertia;            /* about the y-axis */
+  double transverse_inertia;       /* about a line through the centroid, normal to y */
+}MassProperties;
+
+#define QUERY_BATCH 8
+#define SPAN_SAMPLES 8             /* seeds per span before Newton refinement */
+#define NEWTON_ITERATIONS 12
+#define NEWTON_HALVINGS 10
+
+typedef struct ProfileSpans{
+  double a;                        /* first knot of the span */
+  double h;                        /* span length */
+  double c[PROFILE_DEGREE+1][3];   /* power-basis coefficients in t-a */
+  double lo[3];                    /* control point bounding box */
+  double hi[3];
+}ProfileSpan;
+
+typedef struct ClosestPoints{
+  double distance;
+  double t;                        /* profile parameter */
+  double theta;                    /* rotation about the y-axis, 0 for curve queries */
+}ClosestPoint;
+
+#define DEFAULT_DECIMATION_ERROR 0.005
+#define DECIMATION_PARTITION 256     /* rows per parallel decimation task */
+#define POLE_RADIUS 1e-6
+#define EXPORT_FILE "surface.obj"
+
+static GLfloat decimation_error = DEFAULT_DECIMATION_ERROR;
+
+#define INSTANCE_ATTRIBUTE 4       /* first of the 4 columns of instance_transform */
+#define SCENE_FILE "scene.txt"
+#define MAX_SCENE_NAMES 256
+#define MAX_SCENE_NAME 32
+
+/* A unique profile of the scene and all of its placements. Models read
+   from different files with identical control points are merged, so they
+   share one surface, one mesh and one draw call. */
+typedef struct SceneModels{
+  GLfloat cpts[MAX_CPTS][3];
+  int ncpts;
+  NurbsSurface surface;
+  Mesh mesh;
+  GLfloat tolerance;               /* of the mesh, 0 until it is made */
+  int ninstances;
+  GLfloat (*transform)[16];        /* column-major, one per instance */
+  GLuint instance_buffer;          /* the transforms, uploaded once */
+}SceneModel;
+
+typedef struct SceneNames{
+  char name[MAX_SCENE_NAME];
+  int model;
+}SceneName;
+
+static SceneModel* scene_models = NULL;
+static int nscene_models = 0;
+static int scene_on = 0;
+
+static NurbsSurface bspline_nurbs;
+static unsigned int nurbs_generation = 0;
+static GLfloat surface_tolerance = DEFAULT_SURFACE_TOLERANCE;
+static MeshCacheEntry mesh_cache[MESH_CACHE_ENTRIES];
+static unsigned long mesh_cache_clock = 0;
+static int mesh_disk_cache_on = 1;
 
 static GLfloat rho = 0;
 
 #define TEXTURE_WIDTH 256
 #define TEXTURE_HEIGHT 256
+#define MIN_TEXTURE_SIZE 64
+#define MAX_TEXTURE_SIZE 2048
+#define MIN_TEXTURE_CELLS 2
+#define MAX_TEXTURE_CELLS 64
+#define TEXTURE_OCTAVES 5
+#define TEXTURE_CACHE_ENTRIES 8
+
+typedef enum {
+  TEXTURE_FILE,                    /* ref/marble256.bin */
+  TEXTURE_MARBLE,
+  TEXTURE_WOOD,
+  TEXTURE_CHECKER,
+  TEXTURE_NOISE,
+  TEXTURE_PATTERNS
+} texturePattern;
+
+static const char* texture_pattern_name[TEXTURE_PATTERNS] = {"file", "marble", "wood", "checker", "noise"};
+
+/* Everything a procedural texture depends on; also the cache key, so keep
+   it free of padding */
+typedef struct TextureParametersStruct{
+  int pattern;
+  int size;                        /* power of two, at most MAX_TEXTURE_SIZE */
+  int cells;                       /* power of two: noise lattice cells, stripes or checks per side */
+  unsigned int seed;
+}TextureParameters;
+
+typedef struct TextureCacheEntries{
+  TextureParameters parameters;
+  GLuint name;
+  unsigned long last_use;          /* 0 marks an empty slot */
+}TextureCacheEntry;
+
+static TextureParameters texture_parameters = {TEXTURE_FILE, 256, 8, 1};
+static TextureCacheEntry texture_cache[TEXTURE_CACHE_ENTRIES];
+static unsigned long texture_cache_clock = 0;
 
 static int width = 500, height = 500;     /* Window width and height */
 
-static Vector makeVector(GLfloat* from, GLfloat* to){
-  Vector out;
-  out.x = to[0] - from[0];
-  out.y = to[1] - from[1];
-  out.z = to[2] - from[2];
+static const GLfloat mat_specular[]={1.0, 1.0, 0.0, 1.0};
+static const GLfloat mat_diffuse[]={0.7, 0.7, 0.0, 1.0};
+static const GLfloat mat_ambient[]={0.0, 0.2, 0.0, 1.0};
+static const GLfloat mat_shininess={100.0};
+static const GLfloat light_pos[] = {0.0, 0.0, -7.0, 1.0};
 
-  return out;
-}
+static int per_pixel_lighting = 1;
 
-static Vector normalizeVector(Vector a){
-  Vector n;
-  GLfloat length = sqrt(a.x*a.x+a.y*a.y+a.z*a.z);
-  n.x = a.x / length;
-  n.y = a.y / length;
-  n.z = a.z / length;
+typedef enum {
+  TRACE_MOUSE,
+  TRACE_MOTION,
+  TRACE_KEYBOARD,
+  TRACE_RESHAPE,
+  TRACE_EVENT_TYPES
+} traceEventType;
 
-  return n;
-}
+static const char trace_event_code[TRACE_EVENT_TYPES] = {'m', 'v', 'k', 'r'};
+static const char* trace_event_name[TRACE_EVENT_TYPES] = {"mouse", "motion", "keyboard", "reshape"};
 
-static Vector crossProduct(Vector a, Vector b){
-  Vector c;
+#define TRACE_HISTOGRAM_BUCKETS 24  /* bucket k counts latencies in [2^k, 2^(k+1)) us */
 
-  c.x = a.x*b.z - a.z*b.y;
-  c.y = a.x*b.z - a.z*b.x;
-  c.z = a.x*b.y - a.y*b.x;
+static FILE *trace_record = NULL;
+static long trace_start_us = 0;
 
-  return c;
+static long traceClock(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec*1000000L + now.tv_nsec/1000;
 }
 
 static GLfloat deCasteljau(int i, int p, float t){
@@ -275,180 +503,1202 @@ static void drawBsplineCurve(){
   }
 }
 
-static void calculateBsplineSurface(){
+/* Index of the knot span [knot[span], knot[span+1]) holding t, for a
+   clamped cubic with n control points */
+static int findKnotSpan(const GLfloat* knot, int n, double t){
+  int low = PROFILE_DEGREE;
+  int high = n;
+  int mid;
+
+  if (t >= knot[n])
+    return n-1;
+  if (t <= knot[PROFILE_DEGREE])
+    return PROFILE_DEGREE;
+
+  mid = (low+high)/2;
+  while (t<knot[mid] || t>=knot[mid+1]){
+    if (t < knot[mid])
+      high = mid;
+    else
+      low = mid;
+    mid = (low+high)/2;
+  }
 
-  GLfloat theta_incr = 1/(float) ANGLE_PARTITION;
-  GLfloat theta_incr_rad = theta_incr * M_PI / 180;
-  GLfloat theta = 0;
-  GLfloat i_vertex3x = 0;
-  GLfloat i_vertex3y = 0;
-  GLfloat i_vertex3z = 0;
-  GLfloat ip1_vertex3x = 0;
-  GLfloat ip1_vertex3y = 0;
-  GLfloat ip1_vertex3z = 0;
+  return mid;
+}
 
-  #ifdef DEBUG
-  printf("calculateBsplineSurface() entered\n");
+/* Nonzero cubic basis functions on the given span and their first nd
+   derivatives (The NURBS Book, A2.3). ders[k][j] belongs to control point
+   span-3+j. */
+static void basisFunctionDerivatives(const GLfloat* knot, int span, double t, int nd,
+				     double ders[PROFILE_DERIVATIVES][PROFILE_DEGREE+1]){
+  const int p = PROFILE_DEGREE;
+  double ndu[PROFILE_DEGREE+1][PROFILE_DEGREE+1];
+  double a[2][PROFILE_DEGREE+1];
+  double left[PROFILE_DEGREE+1];
+  double right[PROFILE_DEGREE+1];
+  double saved, temp;
+
+  ndu[0][0] = 1.0;
+  for(int j=1; j<=p; j++){
+    left[j] = t - knot[span+1-j];
+    right[j] = knot[span+j] - t;
+    saved = 0.0;
+    for(int r=0; r<j; r++){
+      ndu[j][r] = right[r+1] + left[j-r];
+      temp = ndu[r][j-1] / ndu[j][r];
+      ndu[r][j] = saved + right[r+1]*temp;
+      saved = left[j-r]*temp;
+    }
+    ndu[j][j] = saved;
+  }
 
-  FILE *out;
-  out = fopen("calculateBsplineSurface_debug.txt","w");
+  for(int j=0; j<=p; j++)
+    ders[0][j] = ndu[j][p];
 
-  printf("theta_incr has value %f\n", theta_incr);
-  #endif
+  for(int r=0; r<=p; r++){
+    int s1 = 0, s2 = 1;
+    a[0][0] = 1.0;
+    for(int k=1; k<=nd; k++){
+      double d = 0.0;
+      int rk = r-k, pk = p-k;
+      int j1, j2;
 
-  for(int i=0; i<num_bspline_pts; i++){
-    bspline_copy[i][0] = bspline[i][0];
-    bspline_copy[i][1] = bspline[i][1];
-    bspline_copy[i][2] = bspline[i][2];
+      if (r >= k){
+	a[s2][0] = a[s1][0] / ndu[pk+1][rk];
+	d = a[s2][0] * ndu[rk][pk];
+      }
+      j1 = (rk >= -1) ? 1 : -rk;
+      j2 = (r-1 <= pk) ? k-1 : p-r;
+      for(int j=j1; j<=j2; j++){
+	a[s2][j] = (a[s1][j]-a[s1][j-1]) / ndu[pk+1][rk+j];
+	d += a[s2][j] * ndu[rk+j][pk];
+      }
+      if (r <= pk){
+	a[s2][k] = -a[s1][k-1] / ndu[pk+1][r];
+	d += a[s2][k] * ndu[r][pk];
+      }
+      ders[k][r] = d;
+      s1 = 1-s1;
+      s2 = 1-s2;
+    }
   }
-  
-  int j = 0;
-  while(theta<DEGREES_OF_REVOLUTION){
-    #ifdef DEBUG
-    fprintf(out, "theta: %f\n", theta);
-    #endif
-    int i = 0;
-    for(; i<num_bspline_pts-1; i++){
-      ip1_vertex3x = bspline_copy[i+1][0]*cos(theta_incr_rad) + bspline_copy[i+1][2]*sin(theta_incr_rad);
-      ip1_vertex3y = bspline_copy[i+1][1];
-      ip1_vertex3z = -1*bspline_copy[i+1][0]*sin(theta_incr_rad) + bspline_copy[i+1][2]*cos(theta_incr_rad);
-      i_vertex3x = bspline_copy[i][0]*cos(theta_incr_rad) + bspline_copy[i][2]*sin(theta_incr_rad);
-      i_vertex3y = bspline_copy[i][1];
-      i_vertex3z = -1*bspline_copy[i][0]*sin(theta_incr_rad) + bspline_copy[i][2]*cos(theta_incr_rad);
-
-      bspline_surface[j][i][0][0] = bspline_copy[i][0];
-      bspline_surface[j][i][0][1] = bspline_copy[i][1];
-      bspline_surface[j][i][0][2] = bspline_copy[i][2];
-      bspline_surface[j][i][1][0] = bspline_copy[i+1][0];
-      bspline_surface[j][i][1][1] = bspline_copy[i+1][1];
-      bspline_surface[j][i][1][2] = bspline_copy[i+1][2];
-      bspline_surface[j][i][2][0] = ip1_vertex3x;
-      bspline_surface[j][i][2][1] = ip1_vertex3y;
-      bspline_surface[j][i][2][2] = ip1_vertex3z;
-
-      bspline_surface[j][i][3][0] = ip1_vertex3x;
-      bspline_surface[j][i][3][1] = ip1_vertex3y;
-      bspline_surface[j][i][3][2] = ip1_vertex3z;
-      bspline_surface[j][i][4][0] = i_vertex3x;
-      bspline_surface[j][i][4][1] = i_vertex3y;
-      bspline_surface[j][i][4][2] = i_vertex3z;
-      bspline_surface[j][i][5][0] = bspline_copy[i][0];
-      bspline_surface[j][i][5][1] = bspline_copy[i][1];
-      bspline_surface[j][i][5][2] = bspline_copy[i][2];
-      
-      #ifdef DEBUG
-      fprintf(out, "triangle 1, vertex 1: %f %f %f\n", bspline_copy[i][0], bspline_copy[i][1], bspline_copy[i][2]);
-      fprintf(out, "triangle 1, vertex 2: %f %f %f\n", bspline_copy[i+1][0], bspline_copy[i+1][1], bspline_copy[i+1][2]);
-      fprintf(out, "triangle 1, vertex 3: %f %f %f\n", ip1_vertex3x, ip1_vertex3y, ip1_vertex3z);
-      fprintf(out, "triangle 2, vertex 1: %f %f %f\n", ip1_vertex3x, ip1_vertex3y, ip1_vertex3z);
-      fprintf(out, "triangle 2, vertex 2: %f %f %f\n", i_vertex3x, i_vertex3y, i_vertex3z);
-      fprintf(out, "triangle 2, vertex 3: %f %f %f\n", bspline_copy[i][0], bspline_copy[i][1], bspline_copy[i][2]);
-      #endif
 
-      bspline_copy[i][0] = i_vertex3x;
-      bspline_copy[i][1] = i_vertex3y;
-      bspline_copy[i][2] = i_vertex3z;
+  int factor = p;
+  for(int k=1; k<=nd; k++){
+    for(int j=0; j<=p; j++)
+      ders[k][j] *= factor;
+    factor *= p-k;
+  }
+}
+
+/* Profile point and first nd derivatives at t, evaluated on a fixed span
+   so that span end points can be reached from either side */
+static void evaluateProfileInSpan(const NurbsSurface* s, int span, double t, int nd,
+				  double d[PROFILE_DERIVATIVES][3]){
+  double ders[PROFILE_DERIVATIVES][PROFILE_DEGREE+1];
+
+  basisFunctionDerivatives(s->uknot, span, t, nd, ders);
+  for(int k=0; k<=nd; k++){
+    d[k][0] = d[k][1] = d[k][2] = 0.0;
+    for(int j=0; j<=PROFILE_DEGREE; j++){
+      const GLfloat* P = s->profile[span-PROFILE_DEGREE+j];
+      d[k][0] += ders[k][j]*P[0];
+      d[k][1] += ders[k][j]*P[1];
+      d[k][2] += ders[k][j]*P[2];
     }
-    bspline_copy[i][0] = ip1_vertex3x;
-    bspline_copy[i][1] = ip1_vertex3y;
-    bspline_copy[i][2] = ip1_vertex3z;
-    
-    theta = theta + theta_incr;
-    j++;
   }
+}
+
+static void evaluateProfile(const NurbsSurface* s, double t, int nd, double d[PROFILE_DERIVATIVES][3]){
+  evaluateProfileInSpan(s, findKnotSpan(s->uknot, s->nu, t), t, nd, d);
+}
+
+/* Takes the control points as the profile of the revolved surface. The
+   knots follow from the number of points, so an unchanged profile keeps
+   its generation and with it every mesh already made from it. */
+static void buildNurbsSurface(NurbsSurface* s, GLfloat (*cpts)[3], int ncpts){
+  if (s->nu == ncpts && memcmp(s->profile, cpts, sizeof(GLfloat)*3*ncpts) == 0)
+    return;
+  s->generation = ++nurbs_generation;
+  if (setKnotArray(s->uknot, ncpts) < 0){
+    s->nu = 0;
+    return;
+  }
+  s->nu = ncpts;
+  memcpy(s->profile, cpts, sizeof(GLfloat)*3*ncpts);
+}
+
+static void freeMesh(Mesh* mesh){
+  if (mesh->mapping != NULL)
+    munmap(mesh->mapping, mesh->mapping_size);
+  else {
+    free(mesh->vertex);
+    free(mesh->normal);
+    free(mesh->texcoord);
+    free(mesh->index);
+  }
+  memset(mesh, 0, sizeof(Mesh));
+}
+
+/* Unit surface normal at angle 0 for a profile point P with tangent T:
+   the sweep direction y-axis x P crossed with T. On the axis the sweep
+   direction vanishes and the one of the tangent is used instead: P leaves
+   the axis along T at the start of the profile and arrives along -T at
+   its end. */
+static void profileNormal(const double* P, const double* T, int at_end, GLfloat* n){
+  double vx = P[2], vz = -P[0];
+  double nx, ny, nz, length;
+
+  if (vx*vx + vz*vz < 1e-12){
+    vx = at_end ? -T[2] : T[2];
+    vz = at_end ? T[0] : -T[0];
+  }
+  nx = -vz*T[1];
+  ny = vz*T[0] - vx*T[2];
+  nz = vx*T[1];
+  length = sqrt(nx*nx + ny*ny + nz*nz);
+  if (length < 1e-12){
+    n[0] = 0; n[1] = 1; n[2] = 0;
+  } else {
+    n[0] = nx/length; n[1] = ny/length; n[2] = nz/length;
+  }
+}
+
+/* Picks a rows x cols sampling of the NURBS surface fine enough that no
+   chord strays more than tolerance from the exact surface. Along the
+   profile the chord error of a segment of parameter length h is bounded by
+   h*h*max|C''|/8, and C'' of a cubic is linear on each span, so its
+   maximum sits at a span end. Around the axis the sagitta of the widest
+   ring gives the angular step. */
+static int planTessellation(const NurbsSurface* s, GLfloat tolerance, TessellationPlan* plan){
+  int* segments = plan->segments;
+  int rows = 1, cols;
+  double max_radius = 0;
+  double d[PROFILE_DERIVATIVES][3];
+
+  if (s->nu < 4)
+    return -1;
+
+  for(int span=PROFILE_DEGREE; span<s->nu; span++){
+    double h = s->uknot[span+1] - s->uknot[span];
+    double max_curvature = 0;
+
+    segments[span] = 0;
+    if (h <= 0)
+      continue;
+    for(int end=0; end<2; end++){
+      evaluateProfileInSpan(s, span, s->uknot[span+end], 2, d);
+      double m = sqrt(d[2][0]*d[2][0] + d[2][1]*d[2][1] + d[2][2]*d[2][2]);
+      if (m > max_curvature)
+	max_curvature = m;
+    }
+    segments[span] = (int) ceil(h*sqrt(max_curvature/(8*tolerance)));
+    if (segments[span] < 1)
+      segments[span] = 1;
+    else if (segments[span] > MAX_SPAN_SEGMENTS)
+      segments[span] = MAX_SPAN_SEGMENTS;
+    rows += segments[span];
+  }
+
+  /* the control points bound the profile, so the widest one bounds the radius */
+  for(int i=0; i<s->nu; i++){
+    double r = sqrt(s->profile[i][0]*s->profile[i][0] + s->profile[i][2]*s->profile[i][2]);
+    if (r > max_radius)
+      max_radius = r;
+  }
+  if (max_radius <= tolerance)
+    cols = MIN_RING_SEGMENTS;
+  else
+    cols = (int) ceil(M_PI / acos(1 - tolerance/max_radius));
+  if (cols < MIN_RING_SEGMENTS)
+    cols = MIN_RING_SEGMENTS;
+  else if (cols > MAX_RING_SEGMENTS)
+    cols = MAX_RING_SEGMENTS;
+  cols++;  /* seam column repeated */
+
+  plan->rows = rows;
+  plan->cols = cols;
+
+  return 0;
+}
+
+/* cos and sin of the cols angles of a revolution, shared by every mesh
+   with that ring count */
+static const GLfloat* ringTable(int cols){
+  RingTable* victim = &ring_tables[ring_table_next];
+
+  for(int k=0; k<RING_TABLE_ENTRIES; k++)
+    if (ring_tables[k].cols == cols)
+      return ring_tables[k].cos_sin;
+
+  GLfloat* table = malloc(sizeof(GLfloat)*cols*2);
+  if (table == NULL)
+    return NULL;
+  for(int c=0; c<cols-1; c++){
+    double theta = 2*M_PI*c/(cols-1);
+    table[c*2] = cos(theta);
+    table[c*2+1] = sin(theta);
+  }
+  /* exactly the identity, so the seam column matches column 0 bit for bit */
+  table[(cols-1)*2] = 1;
+  table[(cols-1)*2+1] = 0;
+  free(victim->cos_sin);
+  victim->cols = cols;
+  victim->cos_sin = table;
+  ring_table_next = (ring_table_next+1) % RING_TABLE_ENTRIES;
+
+  return table;
+}
+
+static int tessellateNurbsSurface(const NurbsSurface* s, const TessellationPlan* plan, Mesh* mesh){
+  const int* segments = plan->segments;
+  int rows = plan->rows, cols = plan->cols;
+  double d[PROFILE_DERIVATIVES][3];
+
+  memset(mesh, 0, sizeof(Mesh));
+  mesh->rows = rows;
+  mesh->cols = cols;
+  mesh->vertex = malloc(sizeof(GLfloat)*rows*cols*3);
+  mesh->normal = malloc(sizeof(GLfloat)*rows*cols*3);
+  mesh->texcoord = malloc(sizeof(GLfloat)*rows*cols*2);
+  mesh->nindex = (rows-1)*(cols-1)*6;
+  mesh->index = malloc(sizeof(GLuint)*mesh->nindex);
+  if (mesh->vertex == NULL || mesh->normal == NULL || mesh->texcoord == NULL || mesh->index == NULL){
+    printf("Error. Could not allocate a %d x %d surface mesh.\n", rows, cols);
+    freeMesh(mesh);
+    return -1;
+  }
+
+  int row = 0;
+  for(int span=PROFILE_DEGREE; span<s->nu; span++){
+    double h = s->uknot[span+1] - s->uknot[span];
+    int last = (span == s->nu-1);
+    for(int k=0; k<segments[span]+last; k++){
+      GLfloat* v = mesh->vertex + row*cols*3;
+      GLfloat* n = mesh->normal + row*cols*3;
+      evaluateProfileInSpan(s, span, s->uknot[span] + h*k/segments[span], 1, d);
+      v[0] = d[0][0]; v[1] = d[0][1]; v[2] = d[0][2];
+      profileNormal(d[0], d[1], row == rows-1, n);
+      row++;
+    }
+  }
+
+  const GLfloat* ring = ringTable(cols);
+  if (ring == NULL){
+    freeMesh(mesh);
+    return -1;
+  }
+  for(int c=1; c<cols; c++){
+    GLfloat cs = ring[c*2], sn = ring[c*2+1];
+    for(int r=0; r<rows; r++){
+      GLfloat* v0 = mesh->vertex + r*cols*3;
+      GLfloat* n0 = mesh->normal + r*cols*3;
+      GLfloat* v = v0 + c*3;
+      GLfloat* n = n0 + c*3;
+      v[0] = v0[0]*cs + v0[2]*sn;
+      v[1] = v0[1];
+      v[2] = -v0[0]*sn + v0[2]*cs;
+      n[0] = n0[0]*cs + n0[2]*sn;
+      n[1] = n0[1];
+      n[2] = -n0[0]*sn + n0[2]*cs;
+    }
+  }
+
+  /* s runs once around the axis, t along the profile by chord length so
+     that the texture is not stretched where samples are dense */
+  double length = 0;
+  for(int r=0; r<rows; r++){
+    GLfloat* v = mesh->vertex + r*cols*3;
+    GLfloat* tc = mesh->texcoord + r*cols*2;
+    if (r > 0){
+      GLfloat* u = v - cols*3;
+      length += sqrt((v[0]-u[0])*(v[0]-u[0]) + (v[1]-u[1])*(v[1]-u[1]) + (v[2]-u[2])*(v[2]-u[2]));
+    }
+    for(int c=0; c<cols; c++){
+      tc[c*2] = c / (GLfloat)(cols-1);
+      tc[c*2+1] = length;
+    }
+  }
+  for(int k=0; k<rows*cols; k++)
+    mesh->texcoord[k*2+1] = length > 0 ? mesh->texcoord[k*2+1]/length : 0;
+
+  GLuint* index = mesh->index;
+  for(int r=0; r<rows-1; r++){
+    for(int c=0; c<cols-1; c++){
+      GLuint a = r*cols + c;
+      GLuint b = a + cols;
+      *index++ = a;   *index++ = b;   *index++ = b+1;
+      *index++ = b+1; *index++ = a+1; *index++ = a;
+    }
+  }
+
   #ifdef DEBUG
-  fclose(out);
+  printf("tessellated surface: %d x %d vertices\n", rows, cols);
   #endif
 
+  return 0;
 }
 
-static void drawBsplineWireframeSurface(){
-  glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
-  glColor4f(0.0, 0.0, 1, 1);
+/* FNV-1a over everything a tessellation depends on: the profile control
+   points, the knot vector, the samples per span and the ring count */
+static unsigned long long meshCacheKey(const NurbsSurface* s, const TessellationPlan* plan){
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char* bytes;
+
+#define HASH_BYTES(data, size)					\
+  bytes = (const unsigned char*) (data);			\
+  for(size_t k=0; k<(size); k++){				\
+    hash ^= bytes[k];						\
+    hash *= 1099511628211ULL;					\
+  }
 
-  int total_angles = DEGREES_OF_REVOLUTION*ANGLE_PARTITION;
-  
-  for(int j=0; j<total_angles; j++){
-    for(int i=0; i<num_bspline_pts; i++){
-      glBegin(GL_TRIANGLES);
-      glVertex3fv(bspline_surface[j][i][0]);
-      glVertex3fv(bspline_surface[j][i][1]);
-      glVertex3fv(bspline_surface[j][i][2]);
-      glEnd();
+  HASH_BYTES(&s->nu, sizeof(s->nu));
+  for(int i=0; i<s->nu; i++){
+    HASH_BYTES(s->profile[i], 3*sizeof(GLfloat));
+  }
+  HASH_BYTES(s->uknot, (s->nu+PROFILE_DEGREE+1)*sizeof(GLfloat));
+  HASH_BYTES(plan->segments+PROFILE_DEGREE, (s->nu-PROFILE_DEGREE)*sizeof(int));
+  HASH_BYTES(&plan->cols, sizeof(plan->cols));
 
-      glBegin(GL_TRIANGLES);
-      glVertex3fv(bspline_surface[j][i][3]);
-      glVertex3fv(bspline_surface[j][i][4]);
-      glVertex3fv(bspline_surface[j][i][5]);
-      glEnd();
+#undef HASH_BYTES
+
+  return hash;
+}
+
+static const char* meshCacheDirectory(){
+  const char* directory = getenv("SURFACE_MESH_CACHE");
+  return directory != NULL ? directory : MESH_CACHE_DIRECTORY;
+}
+
+static size_t meshCacheBudget(){
+  const char* budget = getenv("SURFACE_MESH_CACHE_BUDGET");
+  long megabytes = budget != NULL ? atol(budget) : MESH_CACHE_BUDGET;
+  return (size_t) (megabytes > 0 ? megabytes : MESH_CACHE_BUDGET) << 20;
+}
+
+static size_t meshFileSize(int rows, int cols, int nindex){
+  return sizeof(MeshFileHeader) + sizeof(GLfloat)*rows*cols*8 + sizeof(GLuint)*nindex;
+}
+
+/* Maps a cached mesh file straight into the mesh; the arrays point into
+   the read-only mapping, so a hit costs an open, an mmap and a header check */
+static int loadCachedMesh(unsigned long long key, Mesh* mesh){
+  char path[PATH_MAX];
+  struct stat info;
+  const MeshFileHeader* header;
+  void* mapping;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%016llx.mesh", meshCacheDirectory(), key);
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(MeshFileHeader)){
+    close(fd);
+    return -1;
+  }
+  mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return -1;
+
+  header = mapping;
+  if (memcmp(header->magic, MESH_FILE_MAGIC, 4) != 0 || header->version != MESH_FILE_VERSION ||
+      header->key != key ||
+      meshFileSize(header->rows, header->cols, header->nindex) != (size_t) info.st_size){
+    munmap(mapping, info.st_size);
+    return -1;
+  }
+
+  int vertices = header->rows*header->cols;
+  mesh->rows = header->rows;
+  mesh->cols = header->cols;
+  mesh->nindex = header->nindex;
+  mesh->vertex = (GLfloat*) (header+1);
+  mesh->normal = mesh->vertex + vertices*3;
+  mesh->texcoord = mesh->normal + vertices*3;
+  mesh->index = (GLuint*) (mesh->texcoord + vertices*2);
+  mesh->mapping = mapping;
+  mesh->mapping_size = info.st_size;
+
+  /* the modification time doubles as the last use for eviction */
+  utime(path, NULL);
+
+  return 0;
+}
+
+static int compareCacheFiles(const void* a, const void* b){
+  time_t ta = ((const MeshCacheFile*) a)->last_use;
+  time_t tb = ((const MeshCacheFile*) b)->last_use;
+  return ta < tb ? -1 : ta > tb;
+}
 
+/* Deletes the least recently used mesh files until the cache fits its budget */
+static void evictCachedMeshes(){
+  const char* directory = meshCacheDirectory();
+  DIR* dir = opendir(directory);
+  MeshCacheFile* files = NULL;
+  int nfiles = 0, capacity = 0;
+  size_t total = 0, budget = meshCacheBudget();
+  struct dirent* entry;
+
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL){
+    size_t length = strlen(entry->d_name);
+    struct stat info;
+    char path[PATH_MAX];
+
+    if (length < 5 || strcmp(entry->d_name+length-5, ".mesh") != 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    if (stat(path, &info) < 0)
+      continue;
+    if (nfiles == capacity){
+      capacity = capacity ? 2*capacity : 64;
+      MeshCacheFile* grown = realloc(files, sizeof(MeshCacheFile)*capacity);
+      if (grown == NULL)
+	break;
+      files = grown;
     }
+    strcpy(files[nfiles].path, path);
+    files[nfiles].size = info.st_size;
+    files[nfiles].last_use = info.st_mtime;
+    total += info.st_size;
+    nfiles++;
+  }
+  closedir(dir);
+
+  qsort(files, nfiles, sizeof(MeshCacheFile), compareCacheFiles);
+  for(int k=0; k<nfiles && total>budget; k++){
+    if (unlink(files[k].path) == 0)
+      total -= files[k].size;
   }
+  free(files);
 }
 
-static void drawBsplineLightedSurface(){
-  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-  lightingInit();
+/* Writes to a private temporary name and renames it into place, so that
+   concurrent runs sharing the cache never see a partial file. A mesh
+   bigger than the whole budget would only be evicted again, so it is not
+   written at all. */
+static void storeCachedMesh(unsigned long long key, const Mesh* mesh){
+  const char* directory = meshCacheDirectory();
+  char path[PATH_MAX], temporary[PATH_MAX];
+  MeshFileHeader header;
+  int vertices = mesh->rows*mesh->cols;
+  FILE* out;
+
+  if (meshFileSize(mesh->rows, mesh->cols, mesh->nindex) > meshCacheBudget())
+    return;
+  mkdir(directory, 0755);
+  snprintf(path, sizeof(path), "%s/%016llx.mesh", directory, key);
+  snprintf(temporary, sizeof(temporary), "%s/%016llx.%d.tmp", directory, key, (int) getpid());
+  out = fopen(temporary, "wb");
+  if (out == NULL){
+    printf("Warning: Could not write mesh cache file %s.\n", temporary);
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MESH_FILE_MAGIC, 4);
+  header.version = MESH_FILE_VERSION;
+  header.key = key;
+  header.rows = mesh->rows;
+  header.cols = mesh->cols;
+  header.nindex = mesh->nindex;
+
+  int written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+    fwrite(mesh->vertex, sizeof(GLfloat)*3, vertices, out) == (size_t) vertices &&
+    fwrite(mesh->normal, sizeof(GLfloat)*3, vertices, out) == (size_t) vertices &&
+    fwrite(mesh->texcoord, sizeof(GLfloat)*2, vertices, out) == (size_t) vertices &&
+    fwrite(mesh->index, sizeof(GLuint), mesh->nindex, out) == (size_t) mesh->nindex;
+  if (fclose(out) != 0 || !written || rename(temporary, path) != 0){
+    printf("Warning: Could not write mesh cache file %s.\n", path);
+    unlink(temporary);
+    return;
+  }
+
+  evictCachedMeshes();
+}
+
+/* Mesh of a surface at a tolerance from the on-disk cache, tessellating
+   and adding it there on a miss */
+static int obtainMesh(const NurbsSurface* s, GLfloat tolerance, Mesh* mesh){
+  TessellationPlan plan;
+  unsigned long long key;
+
+  memset(mesh, 0, sizeof(Mesh));
+  if (planTessellation(s, tolerance, &plan) < 0)
+    return -1;
+  if (mesh_disk_cache_on == 0)
+    return tessellateNurbsSurface(s, &plan, mesh);
+  key = meshCacheKey(s, &plan);
+  if (loadCachedMesh(key, mesh) == 0)
+    return 0;
+  if (tessellateNurbsSurface(s, &plan, mesh) < 0)
+    return -1;
+  storeCachedMesh(key, mesh);
+
+  return 0;
+}
+
+/* Tessellations are made on first use and kept per surface and tolerance;
+   the least recently used one is dropped when the cache is full */
+static Mesh* surfaceMesh(const NurbsSurface* s, GLfloat tolerance){
+  MeshCacheEntry* victim = &mesh_cache[0];
+
+  if (s->nu < 4)
+    return NULL;
+
+  mesh_cache_clock++;
+  for(int k=0; k<MESH_CACHE_ENTRIES; k++){
+    MeshCacheEntry* entry = &mesh_cache[k];
+    if (entry->generation == s->generation && entry->tolerance == tolerance){
+      entry->last_use = mesh_cache_clock;
+      return &entry->mesh;
+    }
+    if (entry->last_use < victim->last_use)
+      victim = entry;
+  }
+
+  freeMesh(&victim->mesh);
+  victim->generation = 0;
+  if (obtainMesh(s, tolerance, &victim->mesh) < 0)
+    return NULL;
+  victim->generation = s->generation;
+  victim->tolerance = tolerance;
+  victim->last_use = mesh_cache_clock;
+
+  return &victim->mesh;
+}
+
+static void calculateBsplineSurface(){
+  buildNurbsSurface(&bspline_nurbs, cpts, ncpts);
 
   #ifdef DEBUG
-  FILE *out;
-  out = fopen("bspline_lighted_surface.txt", "w");
+  printf("calculateBsplineSurface(): %d profile control points\n", bspline_nurbs.nu);
   #endif
+}
 
-  int total_angles = DEGREES_OF_REVOLUTION*ANGLE_PARTITION;
-  
-  for(int j=0; j<total_angles; j++){
-    for(int i=0; i<num_bspline_pts; i++){
-      glBegin(GL_TRIANGLES);
-      glVertex3fv(bspline_surface[j][i][0]);
-      glVertex3fv(bspline_surface[j][i][1]);
-      glVertex3fv(bspline_surface[j][i][2]);
-      glEnd();
+/* Mass properties of the solid bounded by the surface and the y-axis, at
+   unit density, straight from the profile. With r(t)^2 = x^2 + z^2 Green's
+   theorem turns each volume integral into a line integral along the
+   profile (the closing segments on or perpendicular to the axis add
+   nothing):
+     V = pi \int r^2 dy          M_y = pi \int r^2 y dy
+     I_axis = pi/2 \int r^4 dy   \int y^2 dV = pi \int r^2 y^2 dy
+   These integrands are polynomials of degree <= 14 on each knot span, so
+   8-point Gauss-Legendre is exact. The area integrals carry |C'| and are
+   integrated on AREA_SUBINTERVALS pieces of each span instead. */
+static int massProperties(const NurbsSurface* s, MassProperties* m){
+  static const double gauss_node[GAUSS_POINTS] = {
+    -0.9602898564975363, -0.7966664774136267, -0.5255324099163290, -0.1834346424956498,
+     0.1834346424956498,  0.5255324099163290,  0.7966664774136267,  0.9602898564975363
+  };
+  static const double gauss_weight[GAUSS_POINTS] = {
+    0.1012285362903763, 0.2223810344533745, 0.3137066458778873, 0.3626837833783620,
+    0.3626837833783620, 0.3137066458778873, 0.2223810344533745, 0.1012285362903763
+  };
+  double volume = 0, moment = 0, axial = 0, second_moment = 0;
+  double area = 0, area_moment = 0;
+
+  memset(m, 0, sizeof(MassProperties));
+  if (s->nu < 4)
+    return -1;
+
+  #pragma omp parallel for reduction(+:volume, moment, axial, second_moment, area, area_moment)
+  for(int span=PROFILE_DEGREE; span<s->nu; span++){
+    double a = s->uknot[span], b = s->uknot[span+1];
+    double d[PROFILE_DERIVATIVES][3];
+
+    if (b <= a)
+      continue;
+
+    for(int g=0; g<GAUSS_POINTS; g++){
+      double t = 0.5*(a+b) + 0.5*(b-a)*gauss_node[g];
+      double w = 0.5*(b-a)*gauss_weight[g];
+      evaluateProfileInSpan(s, span, t, 1, d);
+      double r2 = d[0][0]*d[0][0] + d[0][2]*d[0][2];
+      double y = d[0][1], dy = d[1][1]*w;
+      volume += r2*dy;
+      moment += r2*y*dy;
+      axial += r2*r2*dy;
+      second_moment += r2*y*y*dy;
+    }
 
-      if(i!=num_bspline_pts-1){
-	Vector triangle1_side1 = makeVector(bspline_surface[j][i][1], bspline_surface[j][i][0]);
-	Vector triangle1_side2 = makeVector(bspline_surface[j][i][1], bspline_surface[j][i][2]);
-	Vector triangle1_normal = crossProduct(triangle1_side1, triangle1_side2);
-	Vector normalized_triangle1_normal = normalizeVector(triangle1_normal);
-	glNormal3f(normalized_triangle1_normal.x, normalized_triangle1_normal.y, normalized_triangle1_normal.z);
+    for(int k=0; k<AREA_SUBINTERVALS; k++){
+      double a_k = a + (b-a)*k/AREA_SUBINTERVALS;
+      double b_k = a + (b-a)*(k+1)/AREA_SUBINTERVALS;
+      for(int g=0; g<GAUSS_POINTS; g++){
+	double t = 0.5*(a_k+b_k) + 0.5*(b_k-a_k)*gauss_node[g];
+	double w = 0.5*(b_k-a_k)*gauss_weight[g];
+	evaluateProfileInSpan(s, span, t, 1, d);
+	double r = sqrt(d[0][0]*d[0][0] + d[0][2]*d[0][2]);
+	double ds = sqrt(d[1][0]*d[1][0] + d[1][1]*d[1][1] + d[1][2]*d[1][2])*w;
+	area += r*ds;
+	area_moment += r*d[0][1]*ds;
+      }
+    }
+  }
 
-        #ifdef DEBUG
-	fprintf(out, "1: index j is %d, index i is %d, normal is %f %f %f\n", j, i,
-		normalized_triangle1_normal.x, normalized_triangle1_normal.y, normalized_triangle1_normal.z);
-        #endif
+  /* the sign of the line integrals only reflects which way the profile
+     was drawn */
+  double orientation = volume < 0 ? -1 : 1;
+  m->volume = M_PI*volume*orientation;
+  m->area = 2*M_PI*area;
+  m->centroid = m->volume > 0 ? M_PI*moment*orientation/m->volume : 0;
+  m->area_centroid = m->area > 0 ? 2*M_PI*area_moment/m->area : 0;
+  m->axial_inertia = 0.5*M_PI*axial*orientation;
+  m->transverse_inertia = 0.5*m->axial_inertia + M_PI*second_moment*orientation
+                          - m->volume*m->centroid*m->centroid;
+
+  return 0;
+}
+
+static void printMassProperties(){
+  MassProperties m;
+  long start_us = traceClock();
+
+  if (massProperties(&bspline_nurbs, &m) < 0){
+    printf("Mass properties need at least 4 control points.\n");
+    return;
+  }
+  printf("Volume %g, surface area %g (computed in %ld us)\n", m.volume, m.area, traceClock()-start_us);
+  printf("Centroid y %g (solid), %g (surface)\n", m.centroid, m.area_centroid);
+  printf("Moments of inertia: %g about the axis, %g about a transverse axis through the centroid\n",
+	 m.axial_inertia, m.transverse_inertia);
+}
+
+/* Reads control points written by 'r'; returns how many, or -1 */
+static int loadControlPoints(const char* filename, GLfloat (*pts)[3]){
+  FILE *record = fopen(filename, "r");
+  int i = 0;
+  int index;
+
+  if (record == NULL){
+    printf("Warning: Could not open file to read.\n");
+    return -1;
+  }
+  while (i<MAX_CPTS &&
+	 fscanf(record, "%d %f %f %f", &index, &pts[i][0], &pts[i][1], &pts[i][2]) == 4){
+    if (index != i){
+      printf("Error. Coordinate index invalid. Loop condition broken.\n");
+      break;
+    }
+    i++;
+  }
+  fclose(record);
+
+  return i;
+}
+
+/* Power-basis form of every profile span, C(a+s) = c[0] + c[1]s + c[2]s^2
+   + c[3]s^3, together with a bounding box of its control points: in 3D for
+   curve queries, in the (r, y) half-plane for surface queries */
+static int buildProfileSpans(const NurbsSurface* s, int on_surface, ProfileSpan* spans){
+  double d[PROFILE_DERIVATIVES][3];
+  double e[PROFILE_DERIVATIVES][3];
+  int nspans = 0;
+
+  for(int span=PROFILE_DEGREE; span<s->nu; span++){
+    ProfileSpan* p = &spans[nspans];
+    double h = s->uknot[span+1] - s->uknot[span];
+
+    if (h <= 0)
+      continue;
+    evaluateProfileInSpan(s, span, s->uknot[span], 2, d);
+    evaluateProfileInSpan(s, span, s->uknot[span+1], 2, e);
+    p->a = s->uknot[span];
+    p->h = h;
+    for(int k=0; k<3; k++){
+      p->c[0][k] = d[0][k];
+      p->c[1][k] = d[1][k];
+      p->c[2][k] = d[2][k]/2;
+      p->c[3][k] = (e[2][k]-d[2][k])/(6*h);
+    }
+
+    for(int k=0; k<3; k++){
+      p->lo[k] = DBL_MAX;
+      p->hi[k] = -DBL_MAX;
+    }
+    for(int i=span-PROFILE_DEGREE; i<=span; i++){
+      for(int k=0; k<3; k++){
+	if (s->profile[i][k] < p->lo[k]) p->lo[k] = s->profile[i][k];
+	if (s->profile[i][k] > p->hi[k]) p->hi[k] = s->profile[i][k];
       }
-      
-      glBegin(GL_TRIANGLES);
-      glVertex3fv(bspline_surface[j][i][3]);
-      glVertex3fv(bspline_surface[j][i][4]);
-      glVertex3fv(bspline_surface[j][i][5]);
-      glEnd();
+    }
+    if (on_surface){
+      /* radius range of the xz box; the y range stays where it is */
+      double near_x = p->lo[0] > 0 ? p->lo[0] : (p->hi[0] < 0 ? p->hi[0] : 0);
+      double near_z = p->lo[2] > 0 ? p->lo[2] : (p->hi[2] < 0 ? p->hi[2] : 0);
+      double far_x = fmax(fabs(p->lo[0]), fabs(p->hi[0]));
+      double far_z = fmax(fabs(p->lo[2]), fabs(p->hi[2]));
+      p->lo[0] = sqrt(near_x*near_x + near_z*near_z);
+      p->hi[0] = sqrt(far_x*far_x + far_z*far_z);
+      p->lo[2] = p->hi[2] = 0;
+    }
+    nspans++;
+  }
 
-      if(i!=num_bspline_pts-1){
-	Vector triangle2_side1 = makeVector(bspline_surface[j][i][4], bspline_surface[j][i][3]);
-	Vector triangle2_side2 = makeVector(bspline_surface[j][i][4], bspline_surface[j][i][5]);
-	Vector triangle2_normal = crossProduct(triangle2_side1, triangle2_side2);
-	Vector normalized_triangle2_normal = normalizeVector(triangle2_normal);
-	glNormal3f(normalized_triangle2_normal.x, normalized_triangle2_normal.y, normalized_triangle2_normal.z);
+  return nspans;
+}
 
-        #ifdef DEBUG
-        fprintf(out, "2: index j is %d, index i is %d, normal is %f %f %f\n", j, i,
-		normalized_triangle2_normal.x, normalized_triangle2_normal.y, normalized_triangle2_normal.z);
-        #endif
+static void evaluateProfileSpan(const ProfileSpan* p, double t, double d[PROFILE_DERIVATIVES][3]){
+  double s = t - p->a;
+  for(int k=0; k<3; k++){
+    d[0][k] = p->c[0][k] + s*(p->c[1][k] + s*(p->c[2][k] + s*p->c[3][k]));
+    d[1][k] = p->c[1][k] + s*(2*p->c[2][k] + s*3*p->c[3][k]);
+    d[2][k] = 2*p->c[2][k] + s*6*p->c[3][k];
+  }
+}
+
+/* Squared distance from q to the profile point at t and the first two
+   derivatives of half of it. For surface queries q is (r, y, 0) and the
+   profile is taken in the half-plane as (sqrt(x^2+z^2), y). */
+static double queryDistance(const ProfileSpan* p, int on_surface, const double* q, double t,
+			    double* f, double* df){
+  double d[PROFILE_DERIVATIVES][3];
+  double c[3], c1[3], c2[3];
+
+  evaluateProfileSpan(p, t, d);
+  if (on_surface){
+    double r = sqrt(d[0][0]*d[0][0] + d[0][2]*d[0][2]);
+    double dr, ddr;
+    if (r > 1e-12){
+      dr = (d[0][0]*d[1][0] + d[0][2]*d[1][2]) / r;
+      ddr = (d[1][0]*d[1][0] + d[1][2]*d[1][2] + d[0][0]*d[2][0] + d[0][2]*d[2][2] - dr*dr) / r;
+    } else {
+      /* on the axis r is |C_xz|, which leaves a pole at the start of the
+	 span and comes back to one at its end */
+      dr = sqrt(d[1][0]*d[1][0] + d[1][2]*d[1][2]);
+      if (t > p->a + p->h/2)
+	dr = -dr;
+      ddr = 0;
+    }
+    c[0] = r - q[0];   c1[0] = dr;       c2[0] = ddr;
+    c[1] = d[0][1] - q[1]; c1[1] = d[1][1]; c2[1] = d[2][1];
+    c[2] = 0;          c1[2] = 0;        c2[2] = 0;
+  } else {
+    for(int k=0; k<3; k++){
+      c[k] = d[0][k] - q[k];
+      c1[k] = d[1][k];
+      c2[k] = d[2][k];
+    }
+  }
+
+  *f = c[0]*c1[0] + c[1]*c1[1] + c[2]*c1[2];
+  *df = c1[0]*c1[0] + c1[1]*c1[1] + c1[2]*c1[2] + c[0]*c2[0] + c[1]*c2[1] + c[2]*c2[2];
+  return c[0]*c[0] + c[1]*c[1] + c[2]*c[2];
+}
+
+/* Newton steps on the derivative of the squared distance, kept inside the
+   span and halved whenever they would move away from the minimum */
+static void newtonOnSpan(const ProfileSpan* p, int on_surface, const double* q,
+			 double* t, double* d2){
+  double f, df;
+
+  for(int iteration=0; iteration<NEWTON_ITERATIONS; iteration++){
+    queryDistance(p, on_surface, q, *t, &f, &df);
+    if (f == 0)
+      break;
+    /* where the distance is not convex, go downhill by one sample spacing */
+    double step = df > 0 ? -f/df : (f > 0 ? -p->h : p->h)/SPAN_SAMPLES;
+    double next, dn;
+    int halvings = 0;
+    do {
+      next = *t + step;
+      if (next < p->a) next = p->a;
+      if (next > p->a + p->h) next = p->a + p->h;
+      dn = queryDistance(p, on_surface, q, next, &f, &df);
+      step /= 2;
+    } while (dn > *d2 && ++halvings < NEWTON_HALVINGS);
+    if (dn > *d2)
+      break;
+    step = fabs(next - *t);
+    *t = next;
+    *d2 = dn;
+    if (step < 1e-12*p->h)
+      break;
+  }
+}
+
+/* Samples one span and polishes every sample that is a local minimum */
+static void refineOnSpan(const ProfileSpan* p, int on_surface, const double* q,
+			 double* best_d2, double* best_t){
+  double sample[SPAN_SAMPLES+1];
+  double f, df;
+
+  for(int k=0; k<=SPAN_SAMPLES; k++)
+    sample[k] = queryDistance(p, on_surface, q, p->a + p->h*k/SPAN_SAMPLES, &f, &df);
+
+  for(int k=0; k<=SPAN_SAMPLES; k++){
+    if ((k > 0 && sample[k-1] < sample[k]) || (k < SPAN_SAMPLES && sample[k+1] < sample[k]))
+      continue;
+    double t = p->a + p->h*k/SPAN_SAMPLES;
+    double d2 = sample[k];
+    newtonOnSpan(p, on_surface, q, &t, &d2);
+    if (d2 < *best_d2){
+      *best_d2 = d2;
+      *best_t = t;
+    }
+  }
+}
+
+/* Closest point on the profile curve, or on the surface swept by it, for
+   each of n query points. Surface queries use the rotational symmetry: a
+   point at radius r and height y is closest to the surface exactly where
+   (r, y) is closest to the profile in the half-plane, and theta is the
+   rotation that brings that profile point under the query. Queries go in
+   batches of QUERY_BATCH: the half-plane reduction and the per-span box
+   bounds are computed across the batch in SIMD loops, after which only
+   spans whose box can beat the best distance so far are refined. */
+static int closestPoints(const NurbsSurface* s, int on_surface, const double (*query)[3], long n,
+			 ClosestPoint* out){
+  ProfileSpan spans[MAX_CPTS];
+  int nspans;
+
+  if (s->nu < 4)
+    return -1;
+  nspans = buildProfileSpans(s, on_surface, spans);
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for(long first=0; first<n; first+=QUERY_BATCH){
+    int count = n-first < QUERY_BATCH ? n-first : QUERY_BATCH;
+    double q[3][QUERY_BATCH];
+    double bound[MAX_CPTS][QUERY_BATCH];
+
+    /* a short last batch repeats its first query in the spare lanes */
+    for(int b=0; b<QUERY_BATCH; b++){
+      const double* p = query[first + (b<count ? b : 0)];
+      q[0][b] = p[0];
+      q[1][b] = p[1];
+      q[2][b] = p[2];
+    }
+    if (on_surface){
+      #pragma omp simd
+      for(int b=0; b<QUERY_BATCH; b++){
+	q[0][b] = sqrt(q[0][b]*q[0][b] + q[2][b]*q[2][b]);
+	q[2][b] = 0;
+      }
+    }
+
+    for(int k=0; k<nspans; k++){
+      double lo0 = spans[k].lo[0], lo1 = spans[k].lo[1], lo2 = spans[k].lo[2];
+      double hi0 = spans[k].hi[0], hi1 = spans[k].hi[1], hi2 = spans[k].hi[2];
+      #pragma omp simd
+      for(int b=0; b<QUERY_BATCH; b++){
+	/* the gap to the box along each axis; at most one side is positive */
+	double gx = (lo0-q[0][b] > 0 ? lo0-q[0][b] : 0) + (q[0][b]-hi0 > 0 ? q[0][b]-hi0 : 0);
+	double gy = (lo1-q[1][b] > 0 ? lo1-q[1][b] : 0) + (q[1][b]-hi1 > 0 ? q[1][b]-hi1 : 0);
+	double gz = (lo2-q[2][b] > 0 ? lo2-q[2][b] : 0) + (q[2][b]-hi2 > 0 ? q[2][b]-hi2 : 0);
+	bound[k][b] = gx*gx + gy*gy + gz*gz;
+      }
+    }
+
+    for(int b=0; b<count; b++){
+      double qb[3] = {q[0][b], q[1][b], q[2][b]};
+      double best_d2 = DBL_MAX, best_t = spans[0].a;
+      int nearest = 0;
+
+      for(int k=1; k<nspans; k++)
+	if (bound[k][b] < bound[nearest][b])
+	  nearest = k;
+      refineOnSpan(&spans[nearest], on_surface, qb, &best_d2, &best_t);
+      for(int k=0; k<nspans; k++)
+	if (k != nearest && bound[k][b] < best_d2)
+	  refineOnSpan(&spans[k], on_surface, qb, &best_d2, &best_t);
+
+      ClosestPoint* c = &out[first+b];
+      c->distance = sqrt(best_d2);
+      c->t = best_t;
+      c->theta = 0;
+      if (on_surface && qb[0] > 1e-12){
+	double d[PROFILE_DERIVATIVES][3];
+	const double* p = query[first+b];
+	evaluateProfile(s, best_t, 0, d);
+	/* rotating by theta takes (x, z) to (x cos + z sin, -x sin + z cos),
+	   which adds theta to atan2(-z, x) */
+	c->theta = atan2(-p[2], p[0]) - atan2(-d[0][2], d[0][0]);
+	if (c->theta < 0)
+	  c->theta += 2*M_PI;
       }
     }
   }
 
-  #ifdef DEBUG
-  fclose(out);
-  #endif
+  return 0;
 }
 
-static void drawBsplineTexturedSurface(){
+/* Reads "x y z" lines from a file and prints "distance t theta" for each,
+   against the control points in bspline.txt */
+static int runClosestPointQueries(const char* filename, int on_surface){
+  FILE *in = fopen(filename, "r");
+  double (*query)[3] = NULL;
+  ClosestPoint* result;
+  long n = 0, capacity = 0;
+  long start_us;
+  int loaded;
+
+  if (in == NULL){
+    printf("Warning: Could not open query file %s.\n", filename);
+    return -1;
+  }
+  while (1){
+    if (n == capacity){
+      capacity = capacity ? 2*capacity : 4096;
+      query = realloc(query, sizeof(*query)*capacity);
+      if (query == NULL){
+	printf("Error. Out of memory reading query points.\n");
+	fclose(in);
+	return -1;
+      }
+    }
+    if (fscanf(in, "%lf %lf %lf", &query[n][0], &query[n][1], &query[n][2]) != 3)
+      break;
+    n++;
+  }
+  fclose(in);
+
+  loaded = loadControlPoints("bspline.txt", cpts);
+  if (loaded < 0){
+    free(query);
+    return -1;
+  }
+  ncpts = loaded;
+  calculateBsplineSurface();
+
+  result = malloc(sizeof(ClosestPoint)*(n ? n : 1));
+  start_us = traceClock();
+  if (result == NULL || closestPoints(&bspline_nurbs, on_surface, query, n, result) < 0){
+    printf("Error. Closest point queries need at least 4 control points.\n");
+    free(query);
+    free(result);
+    return -1;
+  }
+  fprintf(stderr, "%ld queries in %ld us\n", n, traceClock()-start_us);
+
+  for(long i=0; i<n; i++)
+    printf("%.9g %.9g %.9g\n", result[i].distance, result[i].t, result[i].theta);
+
+  free(query);
+  free(result);
+  return 0;
+}
+
+/* Draws the mesh once, or with instances > 0 that many times in one
+   instanced call */
+static void drawMesh(const Mesh* mesh, int attributes, int instances){
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, mesh->vertex);
+  if (attributes & MESH_NORMALS){
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, 0, mesh->normal);
+  }
+  if (attributes & MESH_TEXCOORDS){
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, 0, mesh->texcoord);
+  }
+
+  if (instances > 0)
+    glDrawElementsInstanced(GL_TRIANGLES, mesh->nindex, GL_UNSIGNED_INT, mesh->index, instances);
+  else
+    glDrawElements(GL_TRIANGLES, mesh->nindex, GL_UNSIGNED_INT, mesh->index);
+
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+static void drawBsplineWireframeSurface(){
+  Mesh* mesh = surfaceMesh(&bspline_nurbs, surface_tolerance);
+  if (mesh == NULL)
+    return;
+
+  glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
+  glColor4f(0.0, 0.0, 1, 1);
+
+  drawMesh(mesh, 0, 0);
+}
+
+static GLuint compileShader(GLenum type, const char* source){
+  GLuint shader = glCreateShader(type);
+  GLint compiled = 0;
+  char log[1024];
+
+  if (shader == 0)
+    return 0;
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled){
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    printf("Warning: Could not compile lighting shader:\n%s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+
+  return shader;
+}
+
+/* GL_LIGHT0 defaults: white diffuse and specular, no ambient, plus the
+   0.2 global ambient; the viewer is at infinity as in fixed function */
+static const char* lighting_fragment_source =
+  "#version 120\n"
+  "uniform vec4 mat_ambient;\n"
+  "uniform vec4 mat_diffuse;\n"
+  "uniform vec4 mat_specular;\n"
+  "uniform float mat_shininess;\n"
+  "varying vec3 eye_position;\n"
+  "varying vec3 eye_normal;\n"
+  "varying vec3 eye_light;\n"
+  "void main(){\n"
+  "  vec3 n = normalize(gl_FrontFacing ? eye_normal : -eye_normal);\n"
+  "  vec3 l = normalize(eye_light - eye_position);\n"
+  "  vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));\n"
+  "  float diffuse = max(dot(n, l), 0.0);\n"
+  "  float specular = diffuse > 0.0 ? pow(max(dot(n, h), 0.0), mat_shininess) : 0.0;\n"
+  "  gl_FragColor = vec4((0.2*mat_ambient + diffuse*mat_diffuse + specular*mat_specular).rgb,\n"
+  "                      mat_diffuse.a);\n"
+  "}\n";
+
+/* Links a vertex shader with the lighting fragment shader and sets the
+   material and light uniforms, which never change afterwards. An
+   instance_transform attribute, if declared, is bound to
+   INSTANCE_ATTRIBUTE. Returns 0 on failure. */
+static GLuint buildLightingProgram(const char* vertex_source){
+  GLuint program, vertex, fragment;
+  GLint linked = 0;
+
+  if (glGetString(GL_SHADING_LANGUAGE_VERSION) == NULL)
+    return 0;
+  vertex = compileShader(GL_VERTEX_SHADER, vertex_source);
+  fragment = compileShader(GL_FRAGMENT_SHADER, lighting_fragment_source);
+  if (vertex == 0 || fragment == 0){
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    return 0;
+  }
+
+  program = glCreateProgram();
+  glAttachShader(program, vertex);
+  glAttachShader(program, fragment);
+  glBindAttribLocation(program, INSTANCE_ATTRIBUTE, "instance_transform");
+  glLinkProgram(program);
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked){
+    printf("Warning: Could not link lighting shader; using fixed-function lighting.\n");
+    glDeleteProgram(program);
+    return 0;
+  }
+
+  glUseProgram(program);
+  glUniform4fv(glGetUniformLocation(program, "light_position"), 1, light_pos);
+  glUniform4fv(glGetUniformLocation(program, "mat_ambient"), 1, mat_ambient);
+  glUniform4fv(glGetUniformLocation(program, "mat_diffuse"), 1, mat_diffuse);
+  glUniform4fv(glGetUniformLocation(program, "mat_specular"), 1, mat_specular);
+  glUniform1f(glGetUniformLocation(program, "mat_shininess"), mat_shininess);
+  glUseProgram(0);
+
+  return program;
+}
+
+/* Blinn-Phong evaluated per fragment with the same light and material as
+   lightingInit(), so the highlight no longer depends on how finely the
+   surface is tessellated. Built on first use; 0 means fall back to fixed
+   function. */
+static GLuint perPixelLightingProgram(){
+  static const char* vertex_source =
+    "#version 120\n"
+    "uniform vec4 light_position;\n"
+    "varying vec3 eye_position;\n"
+    "varying vec3 eye_normal;\n"
+    "varying vec3 eye_light;\n"
+    "void main(){\n"
+    "  vec4 position = gl_ModelViewMatrix * gl_Vertex;\n"
+    "  eye_position = position.xyz;\n"
+    "  eye_normal = gl_NormalMatrix * gl_Normal;\n"
+    "  eye_light = (gl_ModelViewMatrix * light_position).xyz;\n"
+    "  gl_Position = gl_ProjectionMatrix * position;\n"
+    "}\n";
+  static GLuint program = 0;
+  static int tried = 0;
+
+  if (!tried){
+    program = buildLightingProgram(vertex_source);
+    tried = 1;
+  }
+
+  return program;
+}
+
+/* The same lighting with a per-instance model transform (rotation and
+   uniform scale) read from INSTANCE_ATTRIBUTE. Needs instanced arrays,
+   so OpenGL 3.3. */
+static GLuint instancedLightingProgram(){
+  static const char* vertex_source =
+    "#version 120\n"
+    "uniform vec4 light_position;\n"
+    "attribute mat4 instance_transform;\n"
+    "varying vec3 eye_position;\n"
+    "varying vec3 eye_normal;\n"
+    "varying vec3 eye_light;\n"
+    "void main(){\n"
+    "  vec4 position = gl_ModelViewMatrix * (instance_transform * gl_Vertex);\n"
+    "  eye_position = position.xyz;\n"
+    "  eye_normal = gl_NormalMatrix * (mat3(instance_transform) * gl_Normal);\n"
+    "  eye_light = (gl_ModelViewMatrix * light_position).xyz;\n"
+    "  gl_Position = gl_ProjectionMatrix * position;\n"
+    "}\n";
+  static GLuint program = 0;
+  static int tried = 0;
+  const char* version;
+  int major = 0, minor = 0;
+
+  if (!tried){
+    tried = 1;
+    version = (const char*) glGetString(GL_VERSION);
+    if (version != NULL && sscanf(version, "%d.%d", &major, &minor) == 2 &&
+	(major > 3 || (major == 3 && minor >= 3)))
+      program = buildLightingProgram(vertex_source);
+  }
+
+  return program;
+}
+
+static void drawBsplineLightedSurface(){
+  GLuint program = per_pixel_lighting ? perPixelLightingProgram() : 0;
+  Mesh* mesh = surfaceMesh(&bspline_nurbs, surface_tolerance);
+  if (mesh == NULL)
+    return;
+
+  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+  if (program != 0){
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(program);
+    drawMesh(mesh, MESH_NORMALS, 0);
+    glUseProgram(0);
+  } else {
+    lightingInit();
+    drawMesh(mesh, MESH_NORMALS, 0);
+  }
+}
+
+/* Reads the planar RGB file texture; returns NULL if it is missing */
+static GLubyte* loadFileTexture(const char* filename){
+  FILE *in = fopen(filename, "r");
+  if (in == NULL){
+    printf("Warning: Could not open texture file %s.\n", filename);
+    return NULL;
+  }
+
+  GLubyte (*m_tex)[TEXTURE_HEIGHT][3] = malloc(sizeof(GLubyte)*TEXTURE_WIDTH*TEXTURE_HEIGHT*3);
+  if (m_tex == NULL){
+    fclose(in);
+    return NULL;
+  }
 
-  GLubyte m_tex[TEXTURE_WIDTH][TEXTURE_HEIGHT][3];
-  
-  FILE *in = fopen("ref/marble256.bin", "r");
   #ifdef DEBUG
   FILE *m_tex_out;
   m_tex_out = fopen("marble_texture_read_in.txt", "w");
@@ -477,42 +1727,627 @@ static void drawBsplineTexturedSurface(){
   #ifdef DEBUG
   fclose(m_tex_out);
   #endif
-  
-  GLuint tex_name_array[1];
-  
-  glEnable(GL_TEXTURE_2D);
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 256, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, m_tex);
+  return m_tex[0][0];
+}
+
+/* Lattice value in [0,1] for a hashed corner */
+static inline float latticeValue(unsigned int h){
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return (h & 0xffffff) * (1.0f/0xffffff);
+}
+
+/* Adds one row of periodic fractal value noise, in [0,1], to out. The
+   lattice hash is pure integer arithmetic so the inner loop vectorises;
+   every octave wraps at the texture edge so the seam stays invisible. */
+static void noiseRow(float* out, int size, int y, int cells, int octaves, unsigned int seed){
+  float amplitude = 1.0;
+  float total = 0.0;
+
+  for(int x=0; x<size; x++)
+    out[x] = 0.0;
+
+  for(int o=0; o<octaves; o++){
+    int period = cells << o;
+    float scale = period / (float) size;
+    float fy = y*scale;
+    int iy = (int) fy;
+    float ty = fy - iy;
+    float sy = ty*ty*(3 - 2*ty);
+    unsigned int octave_seed = (seed + o) * 0xcb1ab31fu;
+    unsigned int y0 = ((iy & (period-1)) * 0x8da6b343u) ^ octave_seed;
+    unsigned int y1 = (((iy+1) & (period-1)) * 0x8da6b343u) ^ octave_seed;
+
+    #pragma omp simd
+    for(int x=0; x<size; x++){
+      float fx = x*scale;
+      int ix = (int) fx;
+      float tx = fx - ix;
+      float sx = tx*tx*(3 - 2*tx);
+      unsigned int x0 = (ix & (period-1)) * 0xd8163841u;
+      unsigned int x1 = ((ix+1) & (period-1)) * 0xd8163841u;
+      float c00 = latticeValue(x0^y0), c10 = latticeValue(x1^y0);
+      float c01 = latticeValue(x0^y1), c11 = latticeValue(x1^y1);
+      float bottom = c00 + sx*(c10-c00);
+      float top = c01 + sx*(c11-c01);
+      out[x] += amplitude*(bottom + sy*(top-bottom));
+    }
+    total += amplitude;
+    amplitude *= 0.5;
+  }
+
+  for(int x=0; x<size; x++)
+    out[x] /= total;
+}
+
+static void mixColor(GLubyte* pixel, const GLfloat* a, const GLfloat* b, float f){
+  if (f < 0) f = 0;
+  if (f > 1) f = 1;
+  pixel[0] = 255*(a[0] + f*(b[0]-a[0]));
+  pixel[1] = 255*(a[1] + f*(b[1]-a[1]));
+  pixel[2] = 255*(a[2] + f*(b[2]-a[2]));
+}
+
+/* Builds a size x size RGB pattern, one row per thread at a time */
+static GLubyte* generateProceduralTexture(const TextureParameters* p){
+  static const GLfloat marble_base[3] = {0.92, 0.90, 0.86};
+  static const GLfloat marble_vein[3] = {0.25, 0.27, 0.32};
+  static const GLfloat wood_light[3] = {0.80, 0.58, 0.34};
+  static const GLfloat wood_dark[3] = {0.45, 0.26, 0.12};
+  static const GLfloat checker_light[3] = {0.95, 0.95, 0.95};
+  static const GLfloat checker_dark[3] = {0.15, 0.15, 0.15};
+  static const GLfloat black[3] = {0, 0, 0};
+  static const GLfloat white[3] = {1, 1, 1};
+  int size = p->size;
+  GLubyte* pixels = malloc(sizeof(GLubyte)*size*size*3);
+
+  if (pixels == NULL)
+    return NULL;
+
+  #pragma omp parallel for schedule(static)
+  for(int y=0; y<size; y++){
+    float noise[MAX_TEXTURE_SIZE];
+    GLubyte* row = pixels + y*size*3;
+
+    if (p->pattern != TEXTURE_CHECKER)
+      noiseRow(noise, size, y, p->cells, TEXTURE_OCTAVES, p->seed);
+
+    for(int x=0; x<size; x++){
+      float u = x / (float) size, v = y / (float) size;
+      switch (p->pattern) {
+      case TEXTURE_MARBLE:
+	mixColor(row+x*3, marble_base, marble_vein,
+		 pow(0.5 + 0.5*sin(2*M_PI*(p->cells*u + 4*noise[x])), 6));
+	break;
+      case TEXTURE_WOOD: {
+	float rings = p->cells*v + 2*noise[x];
+	mixColor(row+x*3, wood_light, wood_dark, rings - floor(rings));
+	break;
+      }
+      case TEXTURE_CHECKER:
+	mixColor(row+x*3, checker_light, checker_dark,
+		 ((int)(p->cells*u) + (int)(p->cells*v)) & 1);
+	break;
+      default:
+	mixColor(row+x*3, black, white, noise[x]);
+	break;
+      }
+    }
+  }
+
+  return pixels;
+}
+
+/* GL texture for a parameter set, generated and uploaded only the first
+   time it is asked for */
+static GLuint surfaceTexture(const TextureParameters* p){
+  TextureCacheEntry* victim = &texture_cache[0];
+  GLubyte* pixels = NULL;
+  int size = p->size;
+
+  texture_cache_clock++;
+  for(int k=0; k<TEXTURE_CACHE_ENTRIES; k++){
+    TextureCacheEntry* entry = &texture_cache[k];
+    if (entry->last_use != 0 && memcmp(&entry->parameters, p, sizeof(TextureParameters)) == 0){
+      entry->last_use = texture_cache_clock;
+      return entry->name;
+    }
+    if (entry->last_use < victim->last_use)
+      victim = entry;
+  }
+
+  if (p->pattern == TEXTURE_FILE){
+    pixels = loadFileTexture("ref/marble256.bin");
+    if (pixels != NULL)
+      size = TEXTURE_WIDTH;
+  }
+  if (pixels == NULL){
+    TextureParameters fallback = *p;
+    if (fallback.pattern == TEXTURE_FILE)
+      fallback.pattern = TEXTURE_MARBLE;
+    pixels = generateProceduralTexture(&fallback);
+  }
+  if (pixels == NULL)
+    return 0;
+
+  if (victim->last_use != 0)
+    glDeleteTextures(1, &victim->name);
+  glGenTextures(1, &victim->name);
+  glBindTexture(GL_TEXTURE_2D, victim->name);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  free(pixels);
+
+  victim->parameters = *p;
+  victim->last_use = texture_cache_clock;
+
+  return victim->name;
+}
+
+static void drawBsplineTexturedSurface(){
+  Mesh* mesh = surfaceMesh(&bspline_nurbs, surface_tolerance);
+  if (mesh == NULL)
+    return;
+
+  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, surfaceTexture(&texture_parameters));
   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
 
-  int total_angles = DEGREES_OF_REVOLUTION*ANGLE_PARTITION;
-  for(int j=0; j<total_angles; j++){
-    for(int i=0; i<num_bspline_pts; i++){
-      glBegin(GL_TRIANGLES);
-      glTexCoord2f(j/total_angles, i/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][0]);
-      glTexCoord2f(j/total_angles, (i+1)/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][1]);
-      glTexCoord2f((j+1)/total_angles, i/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][2]);
-      glEnd();
+  drawMesh(mesh, MESH_TEXCOORDS, 0);
 
-      glBegin(GL_TRIANGLES);
-      glTexCoord2f((j+1)/total_angles, (i+1)/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][3]);
-      glTexCoord2f((j+1)/total_angles, i/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][4]);
-      glTexCoord2f(j/total_angles, i/num_bspline_pts);
-      glVertex3fv(bspline_surface[j][i][5]);
-      glEnd();
+  glDisable(GL_TEXTURE_2D);
+}
+
+static double pointSegmentDistance(const GLfloat* p, const GLfloat* a, const GLfloat* b){
+  double ab[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+  double ap[3] = {p[0]-a[0], p[1]-a[1], p[2]-a[2]};
+  double length2 = ab[0]*ab[0] + ab[1]*ab[1] + ab[2]*ab[2];
+  double f = length2 > 0 ? (ap[0]*ab[0] + ap[1]*ab[1] + ap[2]*ab[2]) / length2 : 0;
+
+  if (f < 0) f = 0;
+  if (f > 1) f = 1;
+  double dx = ap[0] - f*ab[0], dy = ap[1] - f*ab[1], dz = ap[2] - f*ab[2];
+  return sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+static int isPoleRow(const Mesh* mesh, int row){
+  const GLfloat* v = mesh->vertex + row*mesh->cols*3;
+  return v[0]*v[0] + v[2]*v[2] < POLE_RADIUS*POLE_RADIUS;
+}
+
+/* Marks the rows of [first, last) to keep: walking forward from each kept
+   row, the next one is the farthest whose chord stays within error of
+   every row skipped over; last belongs to the next partition. Every
+   column is a rotation of column 0, so the test on column 0 holds for the
+   whole ring. Pole rows are always kept. */
+static void selectRows(const Mesh* mesh, int first, int last, double error, char* keep){
+  const GLfloat* v = mesh->vertex;
+  int cols3 = mesh->cols*3;
+  int i = first;
+
+  keep[first] = 1;
+  while (i < last){
+    int j = i+1;
+    while (j < last && !isPoleRow(mesh, j)){
+      int fits = 1;
+      for(int k=i+1; k<=j && fits; k++)
+	fits = pointSegmentDistance(v + k*cols3, v + i*cols3, v + (j+1)*cols3) <= error;
+      if (!fits)
+	break;
+      j++;
     }
+    if (j < last)
+      keep[j] = 1;
+    i = j;
   }
+}
 
-  glDisable(GL_TEXTURE_2D);
+/* Reduces a revolved grid to the fewest rows and columns that keep it
+   within error of the input. The surface is a rotation of one profile, so
+   instead of general quadric-error collapses the bound is split between
+   the two directions: rows are dropped along the profile with a chord
+   test, run in parallel over partitions of DECIMATION_PARTITION rows, and
+   columns are thinned evenly until the widest ring's sagitta reaches its
+   share. The first and last rows, pole rows and the repeated seam column
+   always survive, and triangles collapsed at a pole are dropped. */
+static int decimateMesh(const Mesh* in, double error, Mesh* out){
+  int rows = in->rows, cols = in->cols;
+  char* keep = calloc(rows, 1);
+  int* kept_row = malloc(sizeof(int)*rows);
+  int* kept_col = malloc(sizeof(int)*cols);
+  int nrows = 0, ncols, npartitions;
+  double max_radius = 0;
+
+  memset(out, 0, sizeof(Mesh));
+  if (keep == NULL || kept_row == NULL || kept_col == NULL || rows < 2 || cols < 2){
+    free(keep);
+    free(kept_row);
+    free(kept_col);
+    return -1;
+  }
+
+  npartitions = (rows-1 + DECIMATION_PARTITION-1) / DECIMATION_PARTITION;
+  #pragma omp parallel for schedule(dynamic)
+  for(int p=0; p<npartitions; p++){
+    int first = p*DECIMATION_PARTITION;
+    int last = first + DECIMATION_PARTITION < rows-1 ? first + DECIMATION_PARTITION : rows-1;
+    selectRows(in, first, last, error/2, keep);
+  }
+  keep[rows-1] = 1;
+  for(int r=0; r<rows; r++)
+    if (keep[r])
+      kept_row[nrows++] = r;
+
+  for(int r=0; r<rows; r++){
+    const GLfloat* v = in->vertex + r*cols*3;
+    double radius = sqrt(v[0]*v[0] + v[2]*v[2]);
+    if (radius > max_radius)
+      max_radius = radius;
+  }
+  /* widest gap, in original steps, whose chord stays within error/2 */
+  int gap = cols-1;
+  double step = 2*M_PI/(cols-1);
+  if (max_radius > error/2){
+    gap = (int) floor(2*acos(1 - error/(2*max_radius)) / step);
+    if (gap < 1)
+      gap = 1;
+  }
+  ncols = (cols-1 + gap-1) / gap;
+  if (ncols < MIN_RING_SEGMENTS)
+    ncols = cols-1 < MIN_RING_SEGMENTS ? cols-1 : MIN_RING_SEGMENTS;
+  for(int c=0; c<=ncols; c++)
+    kept_col[c] = (int) ((long) c*(cols-1) / ncols);
+  ncols++;
+
+  out->rows = nrows;
+  out->cols = ncols;
+  out->vertex = malloc(sizeof(GLfloat)*nrows*ncols*3);
+  out->normal = malloc(sizeof(GLfloat)*nrows*ncols*3);
+  out->texcoord = malloc(sizeof(GLfloat)*nrows*ncols*2);
+  out->index = malloc(sizeof(GLuint)*(nrows-1)*(ncols-1)*6);
+  if (out->vertex == NULL || out->normal == NULL || out->texcoord == NULL || out->index == NULL){
+    freeMesh(out);
+    free(keep);
+    free(kept_row);
+    free(kept_col);
+    return -1;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int r=0; r<nrows; r++){
+    for(int c=0; c<ncols; c++){
+      int from = kept_row[r]*cols + kept_col[c];
+      int to = r*ncols + c;
+      memcpy(out->vertex + to*3, in->vertex + from*3, sizeof(GLfloat)*3);
+      memcpy(out->normal + to*3, in->normal + from*3, sizeof(GLfloat)*3);
+      memcpy(out->texcoord + to*2, in->texcoord + from*2, sizeof(GLfloat)*2);
+    }
+  }
+
+  GLuint* index = out->index;
+  for(int r=0; r<nrows-1; r++){
+    int bottom_pole = isPoleRow(out, r), top_pole = isPoleRow(out, r+1);
+    for(int c=0; c<ncols-1; c++){
+      GLuint a = r*ncols + c;
+      GLuint b = a + ncols;
+      if (!top_pole){
+	*index++ = a;   *index++ = b;   *index++ = b+1;
+      }
+      if (!bottom_pole){
+	*index++ = b+1; *index++ = a+1; *index++ = a;
+      }
+    }
+  }
+  out->nindex = index - out->index;
+
+  free(keep);
+  free(kept_row);
+  free(kept_col);
+
+  return 0;
+}
+
+/* Wavefront OBJ with positions, texture coordinates and normals. The
+   grid repeats the seam column and spreads each pole over a whole row;
+   positions are written once so the exported surface is closed, while
+   the seam keeps both its s=0 and s=1 texture coordinates and a pole
+   keeps the normal of every column that meets it. */
+static int exportMeshObj(const char* filename, const Mesh* mesh){
+  FILE* out;
+  int rows = mesh->rows, cols = mesh->cols, ring = cols-1;
+  int* first_position = malloc(sizeof(int)*rows);
+  char* pole = malloc(rows);
+  int npositions = 0;
+
+  if (first_position == NULL || pole == NULL || cols < 2){
+    free(first_position);
+    free(pole);
+    return -1;
+  }
+  for(int r=0; r<rows; r++){
+    pole[r] = isPoleRow(mesh, r);
+    first_position[r] = npositions;
+    npositions += pole[r] ? 1 : ring;
+  }
+
+  out = fopen(filename, "w");
+  if (out == NULL){
+    printf("Warning: Could not open %s for export.\n", filename);
+    free(first_position);
+    free(pole);
+    return -1;
+  }
+  fprintf(out, "# surface of revolution, %d x %d grid\n", rows, ring);
+  for(int r=0; r<rows; r++)
+    for(int c=0; c<(pole[r] ? 1 : ring); c++){
+      const GLfloat* v = mesh->vertex + (r*cols + c)*3;
+      fprintf(out, "v %f %f %f\n", v[0], v[1], v[2]);
+    }
+  for(int k=0; k<rows*cols; k++)
+    fprintf(out, "vt %f %f\n", mesh->texcoord[k*2], mesh->texcoord[k*2+1]);
+  for(int r=0; r<rows; r++)
+    for(int c=0; c<ring; c++){
+      const GLfloat* n = mesh->normal + (r*cols + c)*3;
+      fprintf(out, "vn %f %f %f\n", n[0], n[1], n[2]);
+    }
+  for(int k=0; k<mesh->nindex; k+=3){
+    fprintf(out, "f");
+    for(int j=0; j<3; j++){
+      GLuint g = mesh->index[k+j];
+      int r = g/cols, c = g%cols % ring;
+      fprintf(out, " %d/%u/%d", first_position[r] + (pole[r] ? 0 : c) + 1, g+1, r*ring + c + 1);
+    }
+    fprintf(out, "\n");
+  }
+  free(first_position);
+  free(pole);
+
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+static void exportSurface(){
+  Mesh* mesh = surfaceMesh(&bspline_nurbs, surface_tolerance);
+  Mesh decimated;
+  long start_us;
+
+  if (mesh == NULL){
+    printf("Export needs at least 4 control points.\n");
+    return;
+  }
+  start_us = traceClock();
+  if (decimateMesh(mesh, decimation_error, &decimated) < 0){
+    printf("Error. Could not decimate the surface mesh.\n");
+    return;
+  }
+  printf("Decimated %d to %d triangles at error %g in %ld us.\n", mesh->nindex/3,
+	 decimated.nindex/3, decimation_error, traceClock()-start_us);
+  if (exportMeshObj(EXPORT_FILE, &decimated) == 0)
+    printf("Surface exported to %s.\n", EXPORT_FILE);
+  freeMesh(&decimated);
+}
+
+static void freeScene(){
+  for(int k=0; k<nscene_models; k++){
+    freeMesh(&scene_models[k].mesh);
+    free(scene_models[k].transform);
+    if (scene_models[k].instance_buffer != 0)
+      glDeleteBuffers(1, &scene_models[k].instance_buffer);
+  }
+  free(scene_models);
+  scene_models = NULL;
+  nscene_models = 0;
+}
+
+/* Column-major scale * Rz * Ry * Rx followed by the translation; angles in
+   degrees */
+static void sceneTransform(GLfloat* m, const GLfloat* translate, const GLfloat* rotate, GLfloat scale){
+  double cx = cos(rotate[0]*M_PI/180), sx = sin(rotate[0]*M_PI/180);
+  double cy = cos(rotate[1]*M_PI/180), sy = sin(rotate[1]*M_PI/180);
+  double cz = cos(rotate[2]*M_PI/180), sz = sin(rotate[2]*M_PI/180);
+  double r[3][3] = {
+    {cz*cy, cz*sy*sx - sz*cx, cz*sy*cx + sz*sx},
+    {sz*cy, sz*sy*sx + cz*cx, sz*sy*cx - cz*sx},
+    {-sy,   cy*sx,            cy*cx}
+  };
+
+  for(int col=0; col<3; col++){
+    for(int row=0; row<3; row++)
+      m[col*4+row] = scale*r[row][col];
+    m[col*4+3] = 0;
+  }
+  m[12] = translate[0];
+  m[13] = translate[1];
+  m[14] = translate[2];
+  m[15] = 1;
+}
+
+/* Index of the scene model with these control points, adding it if no
+   model so far has exactly the same ones */
+static int sceneModel(GLfloat (*pts)[3], int n){
+  for(int k=0; k<nscene_models; k++)
+    if (scene_models[k].ncpts == n && memcmp(scene_models[k].cpts, pts, sizeof(GLfloat)*3*n) == 0)
+      return k;
+
+  SceneModel* grown = realloc(scene_models, sizeof(SceneModel)*(nscene_models+1));
+  if (grown == NULL)
+    return -1;
+  scene_models = grown;
+
+  SceneModel* m = &scene_models[nscene_models];
+  memset(m, 0, sizeof(SceneModel));
+  memcpy(m->cpts, pts, sizeof(GLfloat)*3*n);
+  m->ncpts = n;
+  buildNurbsSurface(&m->surface, m->cpts, n);
+
+  return nscene_models++;
+}
+
+/* Reads a scene description:
+     model <name> <control point file>
+     instance <name> <tx> <ty> <tz> <rx> <ry> <rz> <scale>
+   Lines starting with '#' are comments. */
+static int loadScene(const char* filename){
+  FILE *in = fopen(filename, "r");
+  SceneName names[MAX_SCENE_NAMES];
+  int nnames = 0, ninstances = 0;
+  char line[PATH_MAX+64];
+  char name[MAX_SCENE_NAME], path[PATH_MAX];
+  GLfloat translate[3], rotate[3], scale;
+  GLfloat pts[MAX_CPTS][3];
+
+  if (in == NULL){
+    printf("Warning: Could not open scene file %s.\n", filename);
+    return -1;
+  }
+  freeScene();
+
+  while (fgets(line, sizeof(line), in) != NULL){
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+
+    if (sscanf(line, "model %31s %4095s", name, path) == 2){
+      int n = loadControlPoints(path, pts);
+      int model;
+      if (n < 4){
+	printf("Warning: Scene model %s needs at least 4 control points.\n", name);
+	continue;
+      }
+      if (nnames == MAX_SCENE_NAMES || (model = sceneModel(pts, n)) < 0){
+	printf("Warning: Too many scene models; %s ignored.\n", name);
+	continue;
+      }
+      strcpy(names[nnames].name, name);
+      names[nnames].model = model;
+      nnames++;
+    } else if (sscanf(line, "instance %31s %f %f %f %f %f %f %f", name,
+		      &translate[0], &translate[1], &translate[2],
+		      &rotate[0], &rotate[1], &rotate[2], &scale) == 8){
+      int k = 0;
+      while (k<nnames && strcmp(names[k].name, name) != 0)
+	k++;
+      if (k == nnames){
+	printf("Warning: Unknown scene model %s.\n", name);
+	continue;
+      }
+      SceneModel* m = &scene_models[names[k].model];
+      GLfloat (*grown)[16] = realloc(m->transform, sizeof(GLfloat)*16*(m->ninstances+1));
+      if (grown == NULL)
+	continue;
+      m->transform = grown;
+      sceneTransform(m->transform[m->ninstances++], translate, rotate, scale);
+      ninstances++;
+    } else
+      printf("Error. Malformed scene line: %s", line);
+  }
+  fclose(in);
+
+  for(int k=0; k<nscene_models; k++){
+    SceneModel* m = &scene_models[k];
+    glGenBuffers(1, &m->instance_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m->instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*16*m->ninstances, m->transform, GL_STATIC_DRAW);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  printf("Scene: %d instances of %d unique models.\n", ninstances, nscene_models);
+  return 0;
+}
+
+/* A part drawn at scale s needs tolerance/s in its own coordinates. Models
+   with an enlarged instance are tessellated that much finer; models whose
+   instances are all shrunk get a decimated level of detail instead, the
+   decimation spending whatever the tessellation left over */
+static int obtainSceneMesh(SceneModel* m, GLfloat tolerance){
+  double max_scale = 0;
+  double budget;
+  GLfloat local_tolerance = tolerance;
+  Mesh full;
+
+  for(int i=0; i<m->ninstances; i++){
+    const GLfloat* t = m->transform[i];
+    double scale = sqrt(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+    if (scale > max_scale)
+      max_scale = scale;
+  }
+
+  if (max_scale > 1)
+    local_tolerance = fmax(tolerance/max_scale, MIN_SURFACE_TOLERANCE);
+  if (obtainMesh(&m->surface, local_tolerance, &full) < 0)
+    return -1;
+  budget = max_scale > 0 ? tolerance/max_scale - local_tolerance : 0;
+  if (budget <= 0 || decimateMesh(&full, budget, &m->mesh) < 0){
+    m->mesh = full;
+    return 0;
+  }
+  freeMesh(&full);
+
+  return 0;
+}
+
+/* One draw call per unique model: with the instanced shader all of its
+   placements go out in a single glDrawElementsInstanced, otherwise each
+   placement is drawn with fixed-function lighting under its own matrix */
+static void drawScene(){
+  GLuint program = per_pixel_lighting ? instancedLightingProgram() : 0;
+
+  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+  if (program != 0){
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(program);
+  } else {
+    lightingInit();
+    glEnable(GL_NORMALIZE);
+  }
+
+  for(int k=0; k<nscene_models; k++){
+    SceneModel* m = &scene_models[k];
+
+    if (m->ninstances == 0)
+      continue;
+    if (m->tolerance != surface_tolerance){
+      freeMesh(&m->mesh);
+      m->tolerance = 0;
+      if (obtainSceneMesh(m, surface_tolerance) < 0)
+	continue;
+      m->tolerance = surface_tolerance;
+    }
+
+    if (program != 0){
+      glBindBuffer(GL_ARRAY_BUFFER, m->instance_buffer);
+      for(int c=0; c<4; c++){
+	glEnableVertexAttribArray(INSTANCE_ATTRIBUTE+c);
+	glVertexAttribPointer(INSTANCE_ATTRIBUTE+c, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat)*16,
+			      (const GLvoid*) (sizeof(GLfloat)*4*c));
+	glVertexAttribDivisor(INSTANCE_ATTRIBUTE+c, 1);
+      }
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+      drawMesh(&m->mesh, MESH_NORMALS, m->ninstances);
+
+      for(int c=0; c<4; c++){
+	glVertexAttribDivisor(INSTANCE_ATTRIBUTE+c, 0);
+	glDisableVertexAttribArray(INSTANCE_ATTRIBUTE+c);
+      }
+    } else {
+      for(int i=0; i<m->ninstances; i++){
+	glPushMatrix();
+	glMultMatrixf(m->transform[i]);
+	drawMesh(&m->mesh, MESH_NORMALS, 0);
+	glPopMatrix();
+      }
+    }
+  }
+
+  if (program != 0)
+    glUseProgram(0);
+  else
+    glDisable(GL_NORMALIZE);
 }
 
 static void bsplineMain(){
@@ -571,16 +2406,48 @@ static void display(void){
     bsplineMain();
   }
 
+  if (scene_on == 1)
+    drawScene();
+
   calculate_bspline_curve = 0;
   calculate_bspline_surface = 0;
 
   glFlush();
 }
 
+/* One event per line: <code> <microseconds since start> <a> <b> <x> <y>,
+   where a/b are button/state, key/unused or width/height */
+static void recordTraceEvent(traceEventType type, int a, int b, int x, int y){
+  if (trace_record == NULL)
+    return;
+  fprintf(trace_record, "%c %ld %d %d %d %d\n", trace_event_code[type],
+	  traceClock()-trace_start_us, a, b, x, y);
+}
+
+static void closeTraceRecord(){
+  if (trace_record != NULL){
+    fclose(trace_record);
+    trace_record = NULL;
+  }
+}
+
+static int openTraceRecord(const char* filename){
+  trace_record = fopen(filename, "w");
+  if (trace_record == NULL){
+    printf("Warning: Could not open trace file %s for recording.\n", filename);
+    return -1;
+  }
+  fprintf(trace_record, "# surfaceofrevolutions input trace v1\n");
+  trace_start_us = traceClock();
+  atexit(closeTraceRecord);
+  return 0;
+}
 
 static void mouse(int button, int state, int x, int y){
   float wx, wy;
 
+  recordTraceEvent(TRACE_MOUSE, button, state, x, y);
+
   if (selection_on==0){
     if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN){
       current_button = GLUT_LEFT_BUTTON;
@@ -669,6 +2536,8 @@ static void mouse(int button, int state, int x, int y){
 static void moveObject(int x, int y){
   float wx;
   float wy;
+
+  recordTraceEvent(TRACE_MOTION, 0, 0, x, y);
   wx = (2.0 * x) / (float)(width - 1) - 1.0;
   wy = (2.0 * (height - 1 - y)) / (float)(height - 1) - 1.0;
   if ( selection_on==1 && current_button == GLUT_LEFT_BUTTON ){
@@ -690,10 +2559,9 @@ static void moveObject(int x, int y){
 /* This routine handles keystroke commands */
 static void keyboard(unsigned char key, int x, int y){
   FILE *record;
-  int fileSuccessfullyRead1;
-  int fileSuccessfullyRead2;
-  int fileSuccessfullyRead3;
-  int fileSuccessfullyRead4;
+  int loaded;
+
+  recordTraceEvent(TRACE_KEYBOARD, key, 0, x, y);
   
   switch (key) {
   case 'q': case 'Q':
@@ -702,6 +2570,7 @@ static void keyboard(unsigned char key, int x, int y){
   case 'c': case 'C':
     ncpts = 0;
     num_bspline_pts = 0;
+    calculate_bspline_surface = 1;
   case 'h': case 'H':
     rho = 0;
     break;
@@ -770,33 +2639,72 @@ static void keyboard(unsigned char key, int x, int y){
       printf("Control points recorded in file.\n");
     }
     break;
+  case 'w': case 'W':
+    calculateBsplineSurface();
+    exportSurface();
+    break;
+  case '<':
+    if (decimation_error/2 >= MIN_SURFACE_TOLERANCE)
+      decimation_error /= 2;
+    printf("Decimation error is %g.\n", decimation_error);
+    break;
+  case '>':
+    if (decimation_error*2 <= MAX_SURFACE_TOLERANCE)
+      decimation_error *= 2;
+    printf("Decimation error is %g.\n", decimation_error);
+    break;
+  case 'o': case 'O':
+    if (scene_on == 0){
+      if (loadScene(SCENE_FILE) == 0)
+	scene_on = 1;
+    } else
+      scene_on = 0;
+    break;
+  case 'f': case 'F':
+    per_pixel_lighting = !per_pixel_lighting;
+    break;
+  case 'm': case 'M':
+    calculateBsplineSurface();
+    printMassProperties();
+    break;
+  case 't': case 'T':
+    texture_parameters.pattern = (texture_parameters.pattern+1) % TEXTURE_PATTERNS;
+    printf("Texture is %s.\n", texture_pattern_name[texture_parameters.pattern]);
+    break;
+  case 'z': case 'Z':
+    if (texture_parameters.size < MAX_TEXTURE_SIZE)
+      texture_parameters.size *= 2;
+    else
+      texture_parameters.size = MIN_TEXTURE_SIZE;
+    printf("Texture size is %d.\n", texture_parameters.size);
+    break;
+  case 'x': case 'X':
+    if (texture_parameters.cells < MAX_TEXTURE_CELLS)
+      texture_parameters.cells *= 2;
+    else
+      texture_parameters.cells = MIN_TEXTURE_CELLS;
+    printf("Texture cells are %d.\n", texture_parameters.cells);
+    break;
+  case 'v': case 'V':
+    texture_parameters.seed++;
+    printf("Texture seed is %u.\n", texture_parameters.seed);
+    break;
+  case '+':
+    if (surface_tolerance/2 >= MIN_SURFACE_TOLERANCE)
+      surface_tolerance /= 2;
+    printf("Surface tolerance is %g.\n", surface_tolerance);
+    break;
+  case '-':
+    if (surface_tolerance*2 <= MAX_SURFACE_TOLERANCE)
+      surface_tolerance *= 2;
+    printf("Surface tolerance is %g.\n", surface_tolerance);
+    break;
   case 'l':case 'L':
-    record = fopen("bspline.txt", "r");
-    if (record == NULL){
-      printf("Warning: Could not open file to read.\n");
-    } else {
-      ncpts = 0;
-      int i=0;
-      int tempVariable=0;
-      do {
-	fileSuccessfullyRead1 = fscanf(record, "%d", &tempVariable);
-	fileSuccessfullyRead2 = fscanf(record, "%f", &cpts[i][0]);
-	fileSuccessfullyRead3 = fscanf(record, "%f", &cpts[i][1]);
-	fileSuccessfullyRead4 = fscanf(record, "%f", &cpts[i][2]);
-	i++;
-      } while(i<MAX_CPTS &&
-	      tempVariable==i &&
-	      fileSuccessfullyRead1 != EOF &&
-	      fileSuccessfullyRead2 != EOF &&
-	      fileSuccessfullyRead3 != EOF &&
-	      fileSuccessfullyRead4 != EOF );
-
-      if (tempVariable!=i){
-	printf("Error. Coordinate index invalid. Loop condition broken.\n");
-	i--;
-      }
-      ncpts = i;
-      fclose(record);
+    loaded = loadControlPoints("bspline.txt", cpts);
+    if (loaded >= 0){
+      ncpts = loaded;
+      calculate_bspline_curve = 1;
+      calculate_bspline_surface = 1;
     }
     break;
   }
@@ -806,6 +2714,8 @@ static void keyboard(unsigned char key, int x, int y){
 
 /* This routine handles window resizes */
 void reshape(int w, int h){
+  recordTraceEvent(TRACE_RESHAPE, w, h, 0, 0);
+
   width = w;
   height = h;
   
@@ -817,35 +2727,164 @@ void reshape(int w, int h){
   glViewport(0, 0, w, h);
 }
 
+/* Material and light model are set once; the light position is given
+   every frame so that it turns with the model as before */
 void lightingInit(){
-  GLfloat mat_specular[]={1.0, 1.0, 0.0, 1.0};
-  GLfloat mat_diffuse[]={0.7, 0.7, 0.0, 1.0};
-  GLfloat mat_ambient[]={0.0, 0.2, 0.0, 1.0};
-  GLfloat mat_shininess={100.0};
-
-  GLfloat light_pos[] = {0.0, 0.0, -7.0, 1.0};
-
-  glLightfv(GL_LIGHT0, GL_POSITION, light_pos);
+  static int initialized = 0;
 
-  glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+  if (!initialized){
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
 
-  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
-  glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient);
-  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
+    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
 
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_AUTO_NORMAL);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_AUTO_NORMAL);
 	
-  glShadeModel(GL_SMOOTH);
+    glShadeModel(GL_SMOOTH);
+    initialized = 1;
+  }
+
+  glLightfv(GL_LIGHT0, GL_POSITION, light_pos);
   glEnable(GL_LIGHTING);
   glEnable(GL_LIGHT0);
 }
 
+static void printLatencyHistogram(traceEventType type, long* bucket, long count,
+				  long total_us, long min_us, long max_us){
+  long most = 0;
+
+  printf("%s: %ld events, min %ld us, mean %ld us, max %ld us\n",
+	 trace_event_name[type], count, min_us, total_us/count, max_us);
+
+  for(int k=0; k<TRACE_HISTOGRAM_BUCKETS; k++)
+    if (bucket[k] > most)
+      most = bucket[k];
+
+  for(int k=0; k<TRACE_HISTOGRAM_BUCKETS; k++){
+    if (bucket[k] == 0)
+      continue;
+    printf("  [%8ld, %8ld) us %6ld ", k==0 ? 0L : 1L<<k, 1L<<(k+1), bucket[k]);
+    for(int n=0; n<(bucket[k]*40+most-1)/most; n++)
+      putchar('#');
+    putchar('\n');
+  }
+}
+
+/* Replays a trace written by -record through the input callbacks as fast as
+   possible. No window is created; without a current context the GL calls
+   made by display() are no-ops, so the latencies are those of the geometry
+   work each event triggers. The on-disk mesh cache is bypassed so that a
+   replay measures the same work whatever earlier runs left on disk. */
+static int replayTrace(const char* filename){
+  FILE *in = fopen(filename, "r");
+  char line[128];
+  char code;
+  long time_us;
+  int a, b, x, y;
+  long bucket[TRACE_EVENT_TYPES][TRACE_HISTOGRAM_BUCKETS] = {{0}};
+  long count[TRACE_EVENT_TYPES] = {0};
+  long total_us[TRACE_EVENT_TYPES] = {0};
+  long min_us[TRACE_EVENT_TYPES];
+  long max_us[TRACE_EVENT_TYPES] = {0};
+
+  if (in == NULL){
+    printf("Warning: Could not open trace file %s to replay.\n", filename);
+    return -1;
+  }
+
+  for(int type=0; type<TRACE_EVENT_TYPES; type++)
+    min_us[type] = LONG_MAX;
+  mesh_disk_cache_on = 0;
+
+  while (fgets(line, sizeof(line), in) != NULL){
+    int type;
+    long start_us, latency_us;
+
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%c %ld %d %d %d %d", &code, &time_us, &a, &b, &x, &y) != 6){
+      printf("Error. Malformed trace line: %s", line);
+      continue;
+    }
+    for(type=0; type<TRACE_EVENT_TYPES && trace_event_code[type]!=code; type++);
+    if (type == TRACE_EVENT_TYPES){
+      printf("Error. Unknown trace event '%c'.\n", code);
+      continue;
+    }
+    /* 'q' would exit before the report is printed */
+    if (type == TRACE_KEYBOARD && (a == 'q' || a == 'Q'))
+      break;
+
+    start_us = traceClock();
+    switch (type) {
+    case TRACE_MOUSE:
+      mouse(a, b, x, y);
+      break;
+    case TRACE_MOTION:
+      moveObject(x, y);
+      break;
+    case TRACE_KEYBOARD:
+      keyboard((unsigned char) a, x, y);
+      break;
+    case TRACE_RESHAPE:
+      reshape(a, b);
+      break;
+    }
+    latency_us = traceClock() - start_us;
+
+    int k = 0;
+    while (k<TRACE_HISTOGRAM_BUCKETS-1 && latency_us >= 1L<<(k+1))
+      k++;
+    bucket[type][k]++;
+    count[type]++;
+    total_us[type] += latency_us;
+    if (latency_us < min_us[type])
+      min_us[type] = latency_us;
+    if (latency_us > max_us[type])
+      max_us[type] = latency_us;
+  }
+  fclose(in);
+
+  for(int type=0; type<TRACE_EVENT_TYPES; type++)
+    if (count[type] > 0)
+      printLatencyHistogram(type, bucket[type], count[type], total_us[type],
+			    min_us[type], max_us[type]);
+
+  return 0;
+}
+
 void main(int argc, char **argv){
+  const char* record_file = NULL;
+  const char* replay_file = NULL;
+  const char* closest_file = NULL;
+  int closest_on_surface = 1;
+
   #ifdef DEBUG
   printf("%d %d %d \n", GLUT_LEFT_BUTTON, GLUT_RIGHT_BUTTON, GLUT_MIDDLE_BUTTON);
   #endif
+
+  for(int i=1; i<argc-1; i++){
+    if (strcmp(argv[i], "-record") == 0)
+      record_file = argv[++i];
+    else if (strcmp(argv[i], "-replay") == 0)
+      replay_file = argv[++i];
+    else if (strcmp(argv[i], "-closest") == 0)
+      closest_file = argv[++i];
+    else if (strcmp(argv[i], "-closest-curve") == 0){
+      closest_file = argv[++i];
+      closest_on_surface = 0;
+    }
+  }
+
+  if (replay_file != NULL)
+    exit(replayTrace(replay_file) < 0 ? 1 : 0);
+  if (closest_file != NULL)
+    exit(runClosestPointQueries(closest_file, closest_on_surface) < 0 ? 1 : 0);
+  if (record_file != NULL)
+    openTraceRecord(record_file);
   
   /* Intialize the program */
   glutInit(&argc, argv);